@@ -7,6 +7,9 @@
 int UIOption::select_mode = UIOption::SELECT_NONE;
 bool UIOption::accel_mode = 1;
 bool UIOption::show_bvh_bbox = 1;
+bool UIOption::brush_mode = 0;
+float UIOption::brush_radius = 0.05f;
+bool UIOption::visible_only = 1;
 
 void UI::initialize()
 {
@@ -100,6 +103,12 @@ void UI::_display_func()
         ImGui::Checkbox("Accel", &UIOption::accel_mode);
         ImGui::SameLine();
         ImGui::Checkbox("BBox", &UIOption::show_bvh_bbox);
+
+        ImGui::Checkbox("Brush", &UIOption::brush_mode);
+        ImGui::SameLine();
+        ImGui::SliderFloat("Radius", &UIOption::brush_radius, 0.005f, 0.5f);
+
+        ImGui::Checkbox("Visible only", &UIOption::visible_only);
     }
 
     ImGui::End();
@@ -16,6 +16,9 @@ public:
 	static int select_mode;
 	static bool accel_mode;
 	static bool show_bvh_bbox;
+	static bool brush_mode;
+	static float brush_radius;
+	static bool visible_only;
 };
 
 class UI
@@ -184,6 +184,33 @@ inline bool IsIntersecting(const Aabb& b, const vec3& origin, const vec3& invDir
 	return t1 > 0 && t1 >= t0 && distance > t0;
 }
 
+// Same test with reciprocal direction, also returns the entry distance
+inline bool IsIntersecting(const Aabb& b, const vec3& origin, const vec3& invDir, float distance, float& entry)
+{
+	float t0 = -FLT_MAX, t1 = FLT_MAX;
+
+	float tx0 = (b.pMin.x - origin.x) * invDir.x;
+	float tx1 = (b.pMax.x - origin.x) * invDir.x;
+
+	t0 = std::max(t0, std::min(tx0, tx1));
+	t1 = std::min(t1, std::max(tx0, tx1));
+
+	float ty0 = (b.pMin.y - origin.y) * invDir.y;
+	float ty1 = (b.pMax.y - origin.y) * invDir.y;
+
+	t0 = std::max(t0, std::min(ty0, ty1));
+	t1 = std::min(t1, std::max(ty0, ty1));
+
+	float tz0 = (b.pMin.z - origin.z) * invDir.z;
+	float tz1 = (b.pMax.z - origin.z) * invDir.z;
+
+	t0 = std::max(t0, std::min(tz0, tz1));
+	t1 = std::min(t1, std::max(tz0, tz1));
+
+	entry = t0;
+	return t1 > 0 && t1 >= t0 && distance > t0;
+}
+
 // Geometric traits of bounding box
 
 inline vec3 GetCentroid(const Aabb& b)
@@ -235,6 +262,13 @@ inline vec3 GetOffset(const Aabb& b, const vec3& p)
 	return o;
 }
 
+// Squared distance from p to the box, 0 inside
+inline float GetDistance2(const Aabb& b, const vec3& p)
+{
+	vec3 d = glm::max(glm::max(b.pMin - p, p - b.pMax), vec3(0.f));
+	return dot(d, d);
+}
+
 inline vec3 Lerp(const Aabb& b, const vec3& t)
 {
 	using glm::lerp;
@@ -272,6 +306,15 @@ inline Aabb Intersect(const Aabb& b1, const Aabb& b2)
 			std::min(b1.pMax.z, b2.pMax.z)) };
 }
 
+// Box of b moved by the affine transform m (Arvo 1990)
+inline Aabb Transform(const Aabb& b, const glm::mat4& m)
+{
+	vec3 c = vec3(m * glm::vec4(GetCentroid(b), 1.f));
+	vec3 h = GetDiagonal(b) * 0.5f;
+	vec3 e = glm::abs(vec3(m[0])) * h.x + glm::abs(vec3(m[1])) * h.y + glm::abs(vec3(m[2])) * h.z;
+	return { c - e, c + e };
+}
+
 inline Aabb Expand(const Aabb& b, float s)
 {
 	return {
@@ -0,0 +1,928 @@
+#include "bench.h"
+
+#include <chrono>
+#include <random>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "bvh.h"
+#include "collider.h"
+#include "parallel.h"
+#include "stackless.h"
+#include "triblock.h"
+#include "viewer.h"
+#include "wbvh.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ms(const Clock::time_point& start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+void bench_build(const TheMesh& mesh, const char* method)
+{
+    TriangleBuffer triangles(mesh);
+    TaskPool& pool = TaskPool::Instance();
+    int maxThreads = pool.GetNumThreads();
+    double serial = 0;
+
+    printf("Build %zd primitives, method = %s\n", mesh.n_faces(), method);
+
+    for (int numThreads = 1; numThreads <= maxThreads; ++numThreads)
+    {
+        pool.SetNumThreads(numThreads);
+
+        Bvh bvh;
+        auto start = Clock::now();
+        float cost = initBvh(bvh, triangles, method);
+        double dt = elapsed_ms(start);
+        if (numThreads == 1) serial = dt;
+
+        printf("Threads = %2d, time = %8.2f ms, speedup = %.2fx, SAH cost = %.3f\n", numThreads, dt, serial / dt, cost);
+    }
+
+    pool.SetNumThreads(maxThreads);
+}
+
+// Random rays from a sphere around the unit box aimed at points inside it
+static void make_rays(int numRays, std::vector<Ray>& rays)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+
+    rays.resize(numRays);
+    for (int i = 0; i < numRays; ++i)
+    {
+        vec3 org;
+        do org = vec3(uniform(rng), uniform(rng), uniform(rng));
+        while (glm::length(org) > 1.f || glm::length(org) < 1e-3f);
+
+        vec3 target(0.5f * uniform(rng), 0.5f * uniform(rng), 0.5f * uniform(rng));
+        rays[i].org = 3.f * glm::normalize(org);
+        rays[i].dir = glm::normalize(target - rays[i].org);
+    }
+}
+
+template <class Tree>
+static bool intersect(const Tree& bvh, const PrimitiveCollide& collide,
+    const vec3& org, const vec3& dir, float& dist, int& numVisits)
+{
+    return bvh.Intersect(collide, org, dir, dist, &numVisits);
+}
+
+static bool intersect(const Bvh& bvh, const PrimitiveCollide& collide,
+    const vec3& org, const vec3& dir, float& dist, int& numVisits)
+{
+    BvhTraceCount trace;
+    bool hit = bvh.Intersect(collide, org, dir, dist, trace);
+    numVisits += trace.numNodes;
+    return hit;
+}
+
+static bool intersect(const StacklessBvh& bvh, const PrimitiveCollide& collide,
+    const vec3& org, const vec3& dir, float& dist, int& numVisits)
+{
+    BvhTraceCount trace;
+    bool hit = bvh.Intersect(collide, org, dir, dist, trace);
+    numVisits += trace.numNodes;
+    return hit;
+}
+
+template <class Tree>
+static void bench_traverse(const char* name, const Tree& bvh, const TriangleBuffer& triangles,
+    const std::vector<Ray>& rays, std::vector<float>& dists)
+{
+    PrimitiveTriangle triangle(triangles);
+    PrimitiveCollide collide(triangle);
+    collide.culling = 0;
+
+    int numRays = static_cast<int>(rays.size());
+    int numVisits = 0, numHits = 0, numDiffs = 0;
+    bool reference = dists.empty();
+    if (reference) dists.resize(numRays);
+
+    auto start = Clock::now();
+    for (int i = 0; i < numRays; ++i)
+    {
+        float dist = FLT_MAX;
+        if (intersect(bvh, collide, rays[i].org, rays[i].dir, dist, numVisits))
+            ++numHits;
+
+        if (reference) dists[i] = dist;
+        else if (dist != dists[i]) ++numDiffs;
+    }
+    double dt = elapsed_ms(start);
+
+    size_t bytes = bvh.GetNodes().size() * sizeof(bvh.GetNodes()[0]);
+    printf("%-5s: nodes = %7zd, memory = %8.2f KB, visits/ray = %6.2f, %7.3f Mrays/s, hits = %d, mismatches = %d\n",
+        name, bvh.GetNodes().size(), bytes / 1024.0, double(numVisits) / numRays,
+        numRays / dt * 1e-3, numHits, numDiffs);
+}
+
+void bench_wide(const TheMesh& mesh, const char* method)
+{
+    TriangleBuffer triangles(mesh);
+    const int numRays = 100000;
+
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    // WideBvh<2> keeps the binary tree and runs the same traversal loop,
+    // so it isolates the effect of the node width
+    WideBvh<2> bvh2;
+    Bvh4 bvh4;
+    Bvh8 bvh8;
+    bvh2.Build(bvh);
+    bvh4.Build(bvh);
+    bvh8.Build(bvh);
+
+    QBvh4 qbvh4;
+    QBvh8 qbvh8;
+    qbvh4.Build(bvh4);
+    qbvh8.Build(bvh8);
+
+    std::vector<Ray> rays;
+    std::vector<float> dists;
+    make_rays(numRays, rays);
+
+    printf("Trace %d rays, method = %s\n", numRays, method);
+    bench_traverse("Bvh", bvh, triangles, rays, dists);
+    bench_traverse("Bvh2", bvh2, triangles, rays, dists);
+    bench_traverse("Bvh4", bvh4, triangles, rays, dists);
+    bench_traverse("Bvh8", bvh8, triangles, rays, dists);
+    bench_traverse("QBvh4", qbvh4, triangles, rays, dists);
+    bench_traverse("QBvh8", qbvh8, triangles, rays, dists);
+}
+
+void bench_occluded(const TheMesh& mesh, const char* method)
+{
+    TriangleBuffer triangles(mesh);
+    const int numRays = 100000;
+
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    // Segments of random length, ending inside or beyond the mesh
+    std::vector<Ray> rays;
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> uniform(1.5f, 4.f);
+    make_rays(numRays, rays);
+    for (Ray& ray : rays)
+        ray.tmax = uniform(rng);
+
+    PrimitiveTriangle triangle(triangles);
+    PrimitiveCollide collide(triangle);
+    PrimitiveOcclude occlude(triangle);
+    collide.culling = 0;
+
+    printf("Occlusion of %d rays, method = %s\n", numRays, method);
+
+    std::vector<char> closest(numRays), anyHit(numRays), batch;
+    int numVisits = 0;
+
+    auto start = Clock::now();
+    for (int i = 0; i < numRays; ++i)
+    {
+        float dist = rays[i].tmax;
+        closest[i] = intersect(bvh, collide, rays[i].org, rays[i].dir, dist, numVisits) ? 1 : 0;
+    }
+    double dtClosest = elapsed_ms(start);
+
+    start = Clock::now();
+    for (int i = 0; i < numRays; ++i)
+        anyHit[i] = bvh.Occluded(occlude, rays[i].org, rays[i].dir, rays[i].tmax) ? 1 : 0;
+    double dtAnyHit = elapsed_ms(start);
+
+    start = Clock::now();
+    bvh.Occluded(occlude, rays, batch);
+    double dtBatch = elapsed_ms(start);
+
+    int numOccluded = 0, numDiffs = 0;
+    for (int i = 0; i < numRays; ++i)
+    {
+        numOccluded += anyHit[i];
+        numDiffs += (closest[i] != anyHit[i]) + (batch[i] != anyHit[i]);
+    }
+
+    int numThreads = TaskPool::Instance().GetNumThreads();
+    printf("Closest hit: %8.2f ms, %7.3f Mrays/s\n", dtClosest, numRays / dtClosest * 1e-3);
+    printf("Any hit    : %8.2f ms, %7.3f Mrays/s, speedup = %.2fx\n", dtAnyHit, numRays / dtAnyHit * 1e-3, dtClosest / dtAnyHit);
+    printf("Batch (%2d) : %8.2f ms, %7.3f Mrays/s, speedup = %.2fx\n", numThreads, dtBatch, numRays / dtBatch * 1e-3, dtClosest / dtBatch);
+    printf("Occluded = %d, mismatches = %d\n", numOccluded, numDiffs);
+}
+
+// Primary rays of a pinhole camera looking at the unit box, ordered by 4x4
+// pixel tiles so that consecutive rays are coherent
+static void make_camera_rays(int width, int height, std::vector<Ray>& rays)
+{
+    vec3 eye(0.f, 0.f, 3.f);
+    float scale = 1.f / height;
+
+    rays.clear();
+    for (int ty = 0; ty < height; ty += 4)
+        for (int tx = 0; tx < width; tx += 4)
+            for (int y = ty; y < ty + 4; ++y)
+                for (int x = tx; x < tx + 4; ++x)
+                {
+                    Ray ray;
+                    ray.org = eye;
+                    ray.dir = glm::normalize(vec3((x - 0.5f * width) * scale, (y - 0.5f * height) * scale, -1.f));
+                    rays.push_back(ray);
+                }
+}
+
+void bench_rays(const TheMesh& mesh, const char* method)
+{
+    TriangleBuffer triangles(mesh);
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    std::vector<Ray> rays;
+    make_camera_rays(512, 384, rays);
+    int numRays = static_cast<int>(rays.size());
+
+    // Reference: one closest-hit query per call. Only distances are
+    // compared, faces at equal distance depend on the traversal order.
+    PrimitiveTriangle triangle(triangles);
+    PrimitiveCollide collide(triangle);
+    collide.culling = 0;
+
+    std::vector<RayHit> reference(numRays);
+    auto start = Clock::now();
+    for (int i = 0; i < numRays; ++i)
+    {
+        float dist = rays[i].tmax;
+        if (bvh.Intersect(collide, rays[i].org, rays[i].dir, dist))
+            reference[i] = { collide.closest.idx(), dist };
+    }
+    double serial = elapsed_ms(start);
+
+    printf("Batch of %d rays, method = %s\n", numRays, method);
+    printf("Single     : %8.2f ms, %7.3f Mrays/s\n", serial, numRays / serial * 1e-3);
+
+    TaskPool& pool = TaskPool::Instance();
+    int maxThreads = pool.GetNumThreads();
+
+    for (int numThreads = 1; numThreads <= maxThreads; ++numThreads)
+    {
+        pool.SetNumThreads(numThreads);
+
+        std::vector<RayHit> hits;
+        start = Clock::now();
+        bvh.Intersect(triangle, rays, hits);
+        double dt = elapsed_ms(start);
+
+        int numDiffs = 0;
+        for (int i = 0; i < numRays; ++i)
+            if (hits[i].t != reference[i].t)
+                ++numDiffs;
+
+        printf("Threads %2d : %8.2f ms, %7.3f Mrays/s, speedup = %.2fx, mismatches = %d\n",
+            numThreads, dt, numRays / dt * 1e-3, serial / dt, numDiffs);
+    }
+
+    pool.SetNumThreads(maxThreads);
+
+    for (int packetSize : { 4, 8, 16 })
+    {
+        std::vector<RayHit> hits;
+        start = Clock::now();
+        bvh.Intersect(triangle, rays, hits, packetSize);
+        double dt = elapsed_ms(start);
+
+        int numDiffs = 0;
+        for (int i = 0; i < numRays; ++i)
+            if (hits[i].t != reference[i].t)
+                ++numDiffs;
+
+        printf("Packet %2d  : %8.2f ms, %7.3f Mrays/s, speedup = %.2fx, mismatches = %d\n",
+            packetSize, dt, numRays / dt * 1e-3, serial / dt, numDiffs);
+    }
+}
+
+// Diffuse bounce rays: from random points on random faces into the
+// hemisphere around the face normal, in random order
+static void make_bounce_rays(const TriangleBuffer& triangles, int numRays, std::vector<Ray>& rays)
+{
+    std::mt19937 rng(4);
+    std::uniform_int_distribution<int> face(0, triangles.GetNumFaces() - 1);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    PrimitiveTriangle triangle(triangles);
+
+    rays.resize(numRays);
+    for (Ray& ray : rays)
+    {
+        vec3 v0, v1, v2;
+        triangle(Primitive(face(rng)), v0, v1, v2);
+
+        float a = uniform(rng), b = uniform(rng);
+        if (a + b > 1.f) { a = 1.f - a; b = 1.f - b; }
+        vec3 normal = glm::cross(v1 - v0, v2 - v0);
+        normal = glm::length(normal) > 0.f ? glm::normalize(normal) : vec3(0.f, 0.f, 1.f);
+
+        vec3 dir;
+        do dir = vec3(2.f * uniform(rng) - 1.f, 2.f * uniform(rng) - 1.f, 2.f * uniform(rng) - 1.f);
+        while (glm::length(dir) > 1.f || glm::length(dir) < 1e-3f);
+        dir = glm::normalize(dir);
+        if (glm::dot(dir, normal) < 0.f) dir = -dir;
+
+        ray.org = v0 + a * (v1 - v0) + b * (v2 - v0);
+        ray.dir = dir;
+        ray.tmin = 1e-4f;
+    }
+}
+
+void bench_stream(const TheMesh& mesh, const char* method)
+{
+    TriangleBuffer triangles(mesh);
+    const int numRays = 500000;
+
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    std::vector<Ray> rays;
+    make_bounce_rays(triangles, numRays, rays);
+
+    PrimitiveTriangle triangle(triangles);
+    std::vector<RayHit> reference, hits;
+
+    auto start = Clock::now();
+    bvh.Intersect(triangle, rays, reference);
+    double unsorted = elapsed_ms(start);
+
+    printf("Stream of %d bounce rays, method = %s\n", numRays, method);
+    printf("Unsorted   : %8.2f ms, %7.3f Mrays/s\n", unsorted, numRays / unsorted * 1e-3);
+
+    for (int packetSize : { 1, 8 })
+    {
+        start = Clock::now();
+        bvh.IntersectStream(triangle, rays, hits, packetSize);
+        double dt = elapsed_ms(start);
+
+        int numDiffs = 0;
+        for (int i = 0; i < numRays; ++i)
+            if (hits[i].t != reference[i].t)
+                ++numDiffs;
+
+        printf("Sorted (%2d): %8.2f ms, %7.3f Mrays/s, speedup = %.2fx, mismatches = %d\n",
+            packetSize, dt, numRays / dt * 1e-3, unsorted / dt, numDiffs);
+    }
+}
+
+template <class Context, class Leaves>
+static void bench_leaves(const char* name, const Bvh& bvh, const Leaves& leaves,
+    const std::vector<Ray>& rays, std::vector<float>& dists)
+{
+    int numRays = static_cast<int>(rays.size());
+    int numHits = 0, numDiffs = 0;
+    bool reference = dists.empty();
+    if (reference) dists.resize(numRays);
+
+    BvhTraceCount trace;
+    auto start = Clock::now();
+    for (int i = 0; i < numRays; ++i)
+    {
+        Context context(leaves, rays[i].tmin);
+        float dist = rays[i].tmax;
+        if (bvh.Intersect(context, rays[i].org, rays[i].dir, dist, trace))
+            ++numHits;
+
+        if (reference) dists[i] = dist;
+        else if (dist != dists[i]) ++numDiffs;
+    }
+    double dt = elapsed_ms(start);
+
+    printf("%-15s: tests/ray = %6.2f, %7.3f Mrays/s, hits = %d, mismatches = %d\n",
+        name, double(trace.numPrimitives) / numRays, numRays / dt * 1e-3, numHits, numDiffs);
+}
+
+void bench_blocks(const TheMesh& mesh)
+{
+    const int numRays = 200000;
+
+    TriangleBuffer triangles(mesh);
+    PrimitiveBound bound(triangles);
+    PrimitiveTriangle triangle(triangles);
+
+    std::vector<Primitive> primitives;
+    for (int i = 0; i < triangles.GetNumFaces(); ++i)
+        primitives.push_back(Primitive(i));
+
+    // Default SAH leaves, and larger leaves priced for block tests
+    PrimitiveSplit split(PrimitiveSplit::SPLIT_SAH);
+    Bvh bvh;
+    bvh.Build(primitives, bound, split, 1);
+
+    split.maxLeafSize = 16;
+    split.costIntersect = 0.25f;
+    Bvh large;
+    large.Build(primitives, bound, split, 1);
+
+    TriangleBlocks4 blocks4, largeBlocks4;
+    TriangleBlocks8 blocks8, largeBlocks8;
+    blocks4.Build(bvh, triangle);
+    blocks8.Build(bvh, triangle);
+    largeBlocks4.Build(large, triangle);
+    largeBlocks8.Build(large, triangle);
+
+    std::vector<Ray> rays;
+    std::vector<float> dists;
+    make_rays(numRays, rays);
+
+    printf("Leaf tests of %d rays\n", numRays);
+    bench_leaves<PrimitiveHit>("Mesh", bvh, triangle, rays, dists);
+    bench_leaves<BlockCollide<4>>("Block4", bvh, blocks4, rays, dists);
+    bench_leaves<BlockCollide<8>>("Block8", bvh, blocks8, rays, dists);
+    bench_leaves<PrimitiveHit>("Mesh, leaf 16", large, triangle, rays, dists);
+    bench_leaves<BlockCollide<4>>("Block4, leaf 16", large, largeBlocks4, rays, dists);
+    bench_leaves<BlockCollide<8>>("Block8, leaf 16", large, largeBlocks8, rays, dists);
+}
+
+void bench_stackless(const TheMesh& mesh, const char* method)
+{
+    TriangleBuffer triangles(mesh);
+    const int numRays = 100000;
+
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    StacklessBvh rope;
+    rope.Build(bvh);
+
+    std::vector<Ray> rays;
+    std::vector<float> dists;
+    make_rays(numRays, rays);
+
+    // Traversal state besides the ray: node index, hit flag and, with a
+    // stack, the pending nodes with their entry distances
+    size_t stackState = Bvh::kTraversalStackSize * (sizeof(int) + sizeof(float)) +
+        sizeof(std::vector<int>) + sizeof(int) + sizeof(bool);
+    size_t ropeState = sizeof(int) + sizeof(bool);
+
+    printf("Stackless traversal of %d rays, method = %s\n", numRays, method);
+    printf("State per query: stack = %zd bytes, stackless = %zd bytes\n", stackState, ropeState);
+    bench_traverse("Bvh", bvh, triangles, rays, dists);
+    bench_traverse("Rope", rope, triangles, rays, dists);
+}
+
+// Scan-like points: random points of random faces moved along the face
+// normal by up to 5% of the unit box
+static void make_scan_points(const TriangleBuffer& triangles, int numPoints, std::vector<vec3>& points)
+{
+    std::mt19937 rng(5);
+    std::uniform_int_distribution<int> face(0, triangles.GetNumFaces() - 1);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+
+    points.resize(numPoints);
+    for (vec3& p : points)
+    {
+        vec3 v0, v1, v2;
+        triangles.GetTriangle(face(rng), v0, v1, v2);
+
+        float a = uniform(rng), b = uniform(rng);
+        if (a + b > 1.f) { a = 1.f - a; b = 1.f - b; }
+        vec3 normal = glm::cross(v1 - v0, v2 - v0);
+        normal = glm::length(normal) > 0.f ? glm::normalize(normal) : vec3(0.f, 0.f, 1.f);
+
+        p = v0 + a * (v1 - v0) + b * (v2 - v0) + normal * (0.1f * uniform(rng) - 0.05f);
+    }
+}
+
+void bench_closest(const TheMesh& mesh, const char* method)
+{
+    const int numPoints = 200000;
+    const int numBrute = 200;
+
+    TriangleBuffer triangles(mesh);
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    std::vector<vec3> points;
+    make_scan_points(triangles, numPoints, points);
+    PrimitiveTriangle triangle(triangles);
+
+    // Reference: every face for the first points
+    auto start = Clock::now();
+    std::vector<float> reference(numBrute, FLT_MAX);
+    for (int i = 0; i < numBrute; ++i)
+    {
+        for (int f = 0; f < triangles.GetNumFaces(); ++f)
+        {
+            vec3 v0, v1, v2;
+            float u, v;
+            triangles.GetTriangle(f, v0, v1, v2);
+            reference[i] = std::min(reference[i], glm::length(GetClosestPoint(v0, v1, v2, points[i], u, v) - points[i]));
+        }
+    }
+    double brute = elapsed_ms(start) * numPoints / numBrute;
+
+    printf("Closest points of %d points, method = %s\n", numPoints, method);
+    printf("Brute force: %8.2f ms (estimated), %7.3f Mpoints/s\n", brute, numPoints / brute * 1e-3);
+
+    TaskPool& pool = TaskPool::Instance();
+    int maxThreads = pool.GetNumThreads();
+    std::vector<int> threadCounts = { 1 };
+    if (maxThreads > 1) threadCounts.push_back(maxThreads);
+
+    for (float maxDist : { FLT_MAX, 0.01f })
+    {
+        for (int numThreads : threadCounts)
+        {
+            pool.SetNumThreads(numThreads);
+
+            std::vector<PointHit> hits;
+            start = Clock::now();
+            bvh.ClosestPoint(triangle, points, maxDist, hits);
+            double dt = elapsed_ms(start);
+
+            int numHits = 0, numDiffs = 0;
+            for (int i = 0; i < numPoints; ++i)
+            {
+                if (hits[i].face >= 0) ++numHits;
+                if (i >= numBrute) continue;
+
+                float expected = reference[i] < maxDist ? reference[i] : FLT_MAX;
+                if (std::fabs(hits[i].dist - expected) > 1e-6f) ++numDiffs;
+            }
+
+            printf("Max %-7g, threads %2d: %8.2f ms, %7.3f Mpoints/s, speedup = %.0fx, found = %d, mismatches = %d\n",
+                maxDist == FLT_MAX ? INFINITY : maxDist, numThreads, dt, numPoints / dt * 1e-3, brute / dt, numHits, numDiffs);
+        }
+    }
+
+    pool.SetNumThreads(maxThreads);
+}
+
+void bench_knearest(const TheMesh& mesh, const char* method)
+{
+    const int numPoints = 100000;
+    const int numBrute = 100;
+
+    TriangleBuffer triangles(mesh);
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    std::vector<vec3> points;
+    make_scan_points(triangles, numPoints, points);
+    PrimitiveTriangle triangle(triangles);
+
+    // Reference: distances to every face for the first points
+    int numFaces = triangles.GetNumFaces();
+    std::vector<std::vector<float>> reference(numBrute, std::vector<float>(numFaces));
+    for (int i = 0; i < numBrute; ++i)
+    {
+        for (int f = 0; f < numFaces; ++f)
+        {
+            vec3 v0, v1, v2;
+            float u, v;
+            triangles.GetTriangle(f, v0, v1, v2);
+            reference[i][f] = glm::length(GetClosestPoint(v0, v1, v2, points[i], u, v) - points[i]);
+        }
+        std::sort(reference[i].begin(), reference[i].end());
+    }
+
+    printf("K nearest faces of %d points, method = %s\n", numPoints, method);
+
+    for (int k : { 1, 8, 32 })
+    {
+        // Single queries reusing one result vector
+        std::vector<PointHit> nearest;
+        auto start = Clock::now();
+        for (int i = 0; i < numPoints; ++i)
+            bvh.KNearest(triangle, points[i], k, nearest);
+        double serial = elapsed_ms(start);
+
+        std::vector<PointHit> hits;
+        start = Clock::now();
+        bvh.KNearest(triangle, points, k, hits);
+        double dt = elapsed_ms(start);
+
+        int numDiffs = 0;
+        for (int i = 0; i < numBrute; ++i)
+            for (int j = 0; j < k && j < numFaces; ++j)
+                if (std::fabs(hits[i * k + j].dist - reference[i][j]) > 1e-6f)
+                    ++numDiffs;
+
+        printf("k = %2d: single %8.2f ms, %7.3f Mpoints/s; batch %8.2f ms, %7.3f Mpoints/s, mismatches = %d\n",
+            k, serial, numPoints / serial * 1e-3, dt, numPoints / dt * 1e-3, numDiffs);
+    }
+}
+
+void bench_query(const TheMesh& mesh, const char* method)
+{
+    const int numQueries = 1000;
+    const int numBrute = 20;
+
+    TriangleBuffer triangles(mesh);
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+
+    std::vector<vec3> centers;
+    make_scan_points(triangles, numQueries, centers);
+    PrimitiveTriangle triangle(triangles);
+
+    printf("Range queries around %d surface points, method = %s\n", numQueries, method);
+
+    for (float radius : { 0.01f, 0.05f, 0.2f })
+    {
+        std::vector<Primitive> faces;
+        size_t numSphere = 0, numBox = 0;
+        int numDiffs = 0;
+
+        auto start = Clock::now();
+        for (const vec3& c : centers)
+        {
+            bvh.QuerySphere(triangle, c, radius, faces);
+            numSphere += faces.size();
+        }
+        double dtSphere = elapsed_ms(start);
+
+        start = Clock::now();
+        for (const vec3& c : centers)
+        {
+            bvh.QueryAabb(triangle, Expand(Bound(c), radius), faces);
+            numBox += faces.size();
+        }
+        double dtBox = elapsed_ms(start);
+
+        // Reference: test every face for the first queries
+        start = Clock::now();
+        for (int i = 0; i < numBrute; ++i)
+        {
+            Aabb box = Expand(Bound(centers[i]), radius);
+            int expectSphere = 0, expectBox = 0;
+            for (int f = 0; f < triangles.GetNumFaces(); ++f)
+            {
+                vec3 v0, v1, v2;
+                float u, v;
+                triangles.GetTriangle(f, v0, v1, v2);
+                vec3 q = GetClosestPoint(v0, v1, v2, centers[i], u, v);
+                if (glm::dot(q - centers[i], q - centers[i]) <= radius * radius) ++expectSphere;
+                if (IsOverlapping(v0, v1, v2, box)) ++expectBox;
+            }
+
+            bvh.QuerySphere(triangle, centers[i], radius, faces);
+            numDiffs += static_cast<int>(faces.size()) != expectSphere;
+            bvh.QueryAabb(triangle, box, faces);
+            numDiffs += static_cast<int>(faces.size()) != expectBox;
+        }
+        double brute = elapsed_ms(start) / numBrute;
+
+        printf("Radius %.2f: sphere %7.3f ms/query, %8.1f faces; box %7.3f ms/query, %8.1f faces; brute force %7.3f ms/query, mismatches = %d\n",
+            radius, dtSphere / numQueries, double(numSphere) / numQueries,
+            dtBox / numQueries, double(numBox) / numQueries, brute, numDiffs);
+    }
+}
+
+void bench_frustum(const TheMesh& mesh, const char* method)
+{
+    const int numQueries = 100;
+    const int numBrute = 10;
+
+    TriangleBuffer triangles(mesh);
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+    PrimitiveTriangle triangle(triangles);
+    PrimitiveOcclude occlude(triangle);
+
+    // Random screen rectangles of a camera at eye looking down -z, with
+    // near and far planes at distance 1 and 10
+    const vec3 eye(0.f, 0.f, 3.f);
+    std::mt19937 rng(6);
+    std::uniform_real_distribution<float> uniform(-0.4f, 0.4f);
+    std::vector<Frustum> frustums(numQueries);
+    for (Frustum& frustum : frustums)
+    {
+        float x0 = uniform(rng), x1 = uniform(rng), y0 = uniform(rng), y1 = uniform(rng);
+        float xs[4] = { x0, x1, x1, x0 };
+        float ys[4] = { y0, y0, y1, y1 };
+        vec3 nearCorners[4], farCorners[4];
+        for (int i = 0; i < 4; ++i)
+        {
+            nearCorners[i] = eye + vec3(xs[i], ys[i], -1.f);
+            farCorners[i] = eye + vec3(xs[i], ys[i], -1.f) * 10.f;
+        }
+        frustum = GetFrustum(nearCorners, farCorners);
+    }
+
+    std::vector<Primitive> faces;
+    size_t numInside = 0, numVisible = 0;
+    double dtVisible = 0.0;
+
+    auto start = Clock::now();
+    for (const Frustum& frustum : frustums)
+    {
+        bvh.QueryFrustum(triangle, frustum, faces);
+        numInside += faces.size();
+    }
+    double dt = elapsed_ms(start);
+
+    // Visible faces: front faces whose centroid is not hidden from the eye
+    for (const Frustum& frustum : frustums)
+    {
+        bvh.QueryFrustum(triangle, frustum, faces);
+
+        start = Clock::now();
+        std::vector<Ray> rays;
+        for (const Primitive& face : faces)
+        {
+            vec3 v0, v1, v2;
+            triangle(face, v0, v1, v2);
+            vec3 centroid = (v0 + v1 + v2) / 3.f;
+            if (glm::dot(glm::cross(v1 - v0, v2 - v0), eye - centroid) <= 0.f) continue;
+
+            Ray ray;
+            ray.org = eye;
+            ray.dir = centroid - eye;
+            ray.tmax = 1.f - 1e-4f;
+            rays.push_back(ray);
+        }
+
+        std::vector<char> occluded;
+        bvh.Occluded(occlude, rays, occluded);
+        dtVisible += elapsed_ms(start);
+
+        for (char o : occluded)
+            numVisible += !o;
+    }
+
+    // Reference: test every face against the first frustums
+    int numDiffs = 0;
+    start = Clock::now();
+    for (int q = 0; q < numBrute; ++q)
+    {
+        int expected = 0;
+        for (int f = 0; f < triangles.GetNumFaces(); ++f)
+        {
+            vec3 v[3];
+            triangles.GetTriangle(f, v[0], v[1], v[2]);
+
+            bool outside = false;
+            for (const glm::vec4& plane : frustums[q].planes)
+            {
+                int numOut = 0;
+                for (const vec3& p : v)
+                    numOut += glm::dot(vec3(plane), p) + plane.w < 0.f;
+                outside = outside || numOut == 3;
+            }
+            expected += !outside;
+        }
+
+        bvh.QueryFrustum(triangle, frustums[q], faces);
+        numDiffs += static_cast<int>(faces.size()) != expected;
+    }
+    double brute = elapsed_ms(start) / numBrute;
+
+    printf("Frustum queries of %d rectangles, method = %s\n", numQueries, method);
+    printf("Query     : %7.3f ms/query, %9.1f faces, brute force %7.3f ms/query, mismatches = %d\n",
+        dt / numQueries, double(numInside) / numQueries, brute, numDiffs);
+    printf("Visibility: %7.3f ms/query, %9.1f faces visible\n",
+        dtVisible / numQueries, double(numVisible) / numQueries);
+}
+
+void bench_collide(const TheMesh& mesh, const char* method)
+{
+    const int numPoses = 8;
+
+    TriangleBuffer triangles(mesh);
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+    PrimitiveTriangle triangle(triangles);
+
+    TaskPool& pool = TaskPool::Instance();
+    int maxThreads = pool.GetNumThreads();
+
+    // Copies of the mesh turned about a random axis and shifted by up to a
+    // quarter of its size, overlapping it more or less
+    const std::vector<BvhNode>& nodes = bvh.GetNodes();
+    float size = glm::length(GetDiagonal(nodes[0].bbox));
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+    std::vector<glm::mat4> poses(numPoses);
+    for (glm::mat4& pose : poses)
+    {
+        vec3 axis = glm::normalize(vec3(uniform(rng), uniform(rng), uniform(rng)));
+        vec3 shift = vec3(uniform(rng), uniform(rng), uniform(rng)) * 0.25f * size;
+        pose = glm::rotate(glm::translate(glm::mat4(1.f), shift), uniform(rng) * 3.14159f, axis);
+    }
+
+    printf("Collide with %d moved copies, %zd faces, method = %s\n", numPoses, mesh.n_faces(), method);
+
+    std::vector<FacePair> pairs;
+    for (const glm::mat4& pose : poses)
+    {
+        auto start = Clock::now();
+        bool collides = bvh.Collides(triangle, bvh, triangle, pose);
+        double dtAny = elapsed_ms(start);
+
+        pool.SetNumThreads(1);
+        start = Clock::now();
+        bvh.CollidePairs(triangle, bvh, triangle, pose, pairs);
+        double serial = elapsed_ms(start);
+        pool.SetNumThreads(maxThreads);
+
+        start = Clock::now();
+        bvh.CollidePairs(triangle, bvh, triangle, pose, pairs);
+        double dt = elapsed_ms(start);
+
+        // Reference: box query of every moved face, exact test of the
+        // faces found
+        std::vector<FacePair> expected;
+        std::vector<Primitive> faces;
+        for (int f = 0; f < triangles.GetNumFaces(); ++f)
+        {
+            vec3 w[3];
+            triangles.GetTriangle(f, w[0], w[1], w[2]);
+            for (vec3& p : w)
+                p = vec3(pose * glm::vec4(p, 1.f));
+
+            bvh.QueryAabb(triangle, Bound(w[0], w[1], w[2]), faces);
+            for (const Primitive& face : faces)
+            {
+                vec3 v0, v1, v2;
+                triangles.GetTriangle(face.idx(), v0, v1, v2);
+                if (IsIntersecting(v0, v1, v2, w[0], w[1], w[2]))
+                    expected.push_back({ face.idx(), f });
+            }
+        }
+        std::sort(expected.begin(), expected.end(), [](const FacePair& a, const FacePair& b)
+        {
+            return a.face0 < b.face0 || (a.face0 == b.face0 && a.face1 < b.face1);
+        });
+
+        int numDiffs = pairs.size() != expected.size() || collides != !expected.empty();
+        for (size_t i = 0; !numDiffs && i < pairs.size(); ++i)
+            numDiffs += pairs[i].face0 != expected[i].face0 || pairs[i].face1 != expected[i].face1;
+
+        printf("Pairs = %7zd, any %8.3f ms, all %8.2f ms, %2d threads %8.2f ms (%.2fx), mismatch = %d\n",
+            pairs.size(), dtAny, serial, maxThreads, dt, serial / dt, numDiffs);
+    }
+}
+
+void bench_self(const TheMesh& mesh, const char* method)
+{
+    TriangleBuffer triangles(mesh);
+    Bvh bvh;
+    initBvh(bvh, triangles, method);
+    PrimitiveTriangle triangle(triangles);
+
+    TaskPool& pool = TaskPool::Instance();
+    int maxThreads = pool.GetNumThreads();
+    double serial = 0;
+
+    printf("Self-intersections of %zd faces, method = %s\n", mesh.n_faces(), method);
+
+    std::vector<FacePair> pairs;
+    for (int numThreads = 1; numThreads <= maxThreads; ++numThreads)
+    {
+        pool.SetNumThreads(numThreads);
+
+        auto start = Clock::now();
+        bvh.SelfCollidePairs(triangle, pairs);
+        double dt = elapsed_ms(start);
+        if (numThreads == 1) serial = dt;
+
+        printf("Threads = %2d, time = %8.2f ms, speedup = %.2fx, %.1f Mfaces/s, pairs = %zd\n",
+            numThreads, dt, serial / dt, mesh.n_faces() / dt * 1e-3, pairs.size());
+    }
+    pool.SetNumThreads(maxThreads);
+
+    // Reference: query of the slightly grown box of every face, as the
+    // triangle-box test can miss faces only touching it, and exact test of
+    // the later faces found that share no vertex with it
+    auto start = Clock::now();
+    std::vector<FacePair> expected;
+    std::vector<Primitive> faces;
+    const std::vector<int>& corners = triangles.GetIndices();
+    for (int f = 0; f < triangles.GetNumFaces(); ++f)
+    {
+        vec3 v0, v1, v2;
+        triangles.GetTriangle(f, v0, v1, v2);
+        bvh.QueryAabb(triangle, Expand(Bound(v0, v1, v2), 1e-6f), faces);
+
+        for (const Primitive& face : faces)
+        {
+            int g = face.idx();
+            if (g <= f) continue;
+
+            bool adjacent = false;
+            for (int i = 0; i < 3; ++i)
+                for (int j = 0; j < 3; ++j)
+                    adjacent = adjacent || corners[3 * f + i] == corners[3 * g + j];
+            if (adjacent) continue;
+
+            vec3 w0, w1, w2;
+            triangles.GetTriangle(g, w0, w1, w2);
+            if (IsIntersecting(v0, v1, v2, w0, w1, w2))
+                expected.push_back({ f, g });
+        }
+    }
+    double brute = elapsed_ms(start);
+
+    int numDiffs = pairs.size() != expected.size();
+    for (size_t i = 0; !numDiffs && i < pairs.size(); ++i)
+        numDiffs += pairs[i].face0 != expected[i].face0 || pairs[i].face1 != expected[i].face1;
+
+    printf("Per-face box queries %8.2f ms, pairs = %zd, mismatch = %d\n", brute, expected.size(), numDiffs);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "Mesh.h"
+
+// Headless benchmarks, run with --bench instead of opening the viewer
+
+// Build time of the Bvh using 1..N threads of the task pool
+void bench_build(const TheMesh& mesh, const char* method);
+
+// Node visits, throughput and memory of 2-, 4- and 8-wide Bvh collapsed
+// from the same binary tree, in full precision and quantized
+void bench_wide(const TheMesh& mesh, const char* method);
+
+// Any-hit Bvh::Occluded against closest hit for the same yes/no answer
+void bench_occluded(const TheMesh& mesh, const char* method);
+
+// Batch closest-hit queries using 1..N threads and ray packets against
+// single queries
+void bench_rays(const TheMesh& mesh, const char* method);
+
+// Incoherent bounce rays traced unsorted and reordered by IntersectStream
+void bench_stream(const TheMesh& mesh, const char* method);
+
+// Stackless traversal along skip links against the stack-based Bvh
+void bench_stackless(const TheMesh& mesh, const char* method);
+
+// Leaf tests through the mesh against SIMD triangle blocks, on SAH trees
+// with default and larger leaves. A block leaf counts as one test.
+void bench_blocks(const TheMesh& mesh);
+
+// Batch closest points of points near the surface against brute force
+void bench_closest(const TheMesh& mesh, const char* method);
+
+// k nearest faces of points near the surface, single and batch queries
+// against brute force
+void bench_knearest(const TheMesh& mesh, const char* method);
+
+// Sphere and box range queries of growing radius against brute force
+void bench_query(const TheMesh& mesh, const char* method);
+
+// Frustum queries of screen rectangles against brute force, and the cost
+// of keeping only the faces seen from the eye
+void bench_frustum(const TheMesh& mesh, const char* method);
+
+// Face pairs between the mesh and moved copies of itself, early exit and
+// all pairs on 1..N threads, against per-face box queries
+void bench_collide(const TheMesh& mesh, const char* method);
+
+// Self-intersecting face pairs on 1..N threads against per-face box
+// queries
+void bench_self(const TheMesh& mesh, const char* method);
+
+#endif // !BENCH_H
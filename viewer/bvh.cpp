@@ -1,9 +1,29 @@
 #include "bvh.h"
 
-#include <stack>
+#include <chrono>
+#include <cmath>
 
-#include "collider.h" // IsIntersecting(...)
-#include "viewer.h"
+#include "collider.h" // IsIntersecting(...), GetClosestPoint(...)
+#include "parallel.h"
+
+// Nodes with more primitives than this build their subtrees as parallel tasks
+static constexpr int kParallelBuildSize = 4096;
+
+// Chunk size of the parallel loops over a node's primitives when splitting
+static constexpr int kSplitGrain = 16384;
+
+// Chunk size of the parallel loops over all primitives or nodes
+static constexpr int kLinearGrain = 4096;
+
+// Chunk size of the parallel loops over ray queries
+static constexpr int kQueryGrain = 256;
+
+// SBVH tries spatial splits only when children of the object split overlap
+// by more than this fraction of the root area (Stich et al. 2009)
+static constexpr float kSpatialSplitAlpha = 1e-5f;
+
+// SBVH stops splitting below this depth to bound reference duplication
+static constexpr int kSpatialMaxDepth = 64;
 
 //struct PrimitiveBound
 //{
@@ -40,25 +60,6 @@
 //	const TheMesh& mesh;
 //};
 
-Aabb PrimitiveBound::operator() (const Primitive& hF) const
-{
-	HalfedgeHandle hH = mesh.halfedge_handle(hF);
-	VertexHandle hV0 = mesh.to_vertex_handle(hH);
-	hH = mesh.next_halfedge_handle(hH);
-	VertexHandle hV1 = mesh.to_vertex_handle(hH);
-	hH = mesh.next_halfedge_handle(hH);
-	VertexHandle hV2 = mesh.to_vertex_handle(hH);
-
-	Point v0 = mesh.point(hV0);
-	Point v1 = mesh.point(hV1);
-	Point v2 = mesh.point(hV2);
-
-	return Bound(
-		v0[0], v0[1], v0[2],
-		v1[0], v1[1], v1[2],
-		v2[0], v2[1], v2[2]);
-}
-
 //struct PrimitiveSplit
 //{
 //	int operator() (std::vector<Primitive>& primitives, int beginId, int endId) const
@@ -82,66 +83,208 @@ Aabb PrimitiveBound::operator() (const Primitive& hF) const
 //	const PrimitiveBound& bound;
 //};
 
-#if 0
+int PrimitiveSplit::operator() (std::vector<PrimitiveRef>& refs, int beginId, int endId) const
+{
+	switch (method)
+	{
+	case SPLIT_MIDDLE:
+		return SplitMiddle(refs, beginId, endId);
+	case SPLIT_SAH:
+		return SplitSah(refs, beginId, endId);
+	default:
+		return SplitEqualCounts(refs, beginId, endId);
+	}
+}
+
+// Centroid bounding box of a range of primitive references
+static Aabb CentroidBound(const std::vector<PrimitiveRef>& refs, int beginId, int endId)
+{
+	std::vector<Aabb> boxes(GetNumChunks(beginId, endId, kSplitGrain), Bound());
+
+	ParallelFor(beginId, endId, kSplitGrain, [&](int b, int e)
+	{
+		Aabb& box = boxes[(b - beginId) / kSplitGrain];
+		for (int i = b; i < e; ++i)
+			box = Union(box, Bound(refs[i].centroid));
+	});
+
+	Aabb cbox = Bound();
+	for (const Aabb& box : boxes)
+		cbox = Union(cbox, box);
+	return cbox;
+}
+
 // Split Method: Middle
 // Partition primitives through node's midpoint
-int PrimitiveSplit::operator() (std::vector<Primitive>& primitives, int beginId, int endId) const
+int PrimitiveSplit::SplitMiddle(std::vector<PrimitiveRef>& refs, int beginId, int endId) const
 {
-	auto beginIter = primitives.begin() + beginId;
-	auto endIter = primitives.begin() + endId;
-	Aabb cbox = Bound(); // centroid bounding box
-
-	for (auto iter = beginIter; iter != endIter; ++iter)
-		cbox = Union(cbox, bound(*iter));
+	Aabb cbox = CentroidBound(refs, beginId, endId); // centroid bounding box
 
 	int dim = GetMaxExtentDim(cbox);
 	float mid = (cbox.pMin[dim] + cbox.pMax[dim]) * 0.5f;
 
-	auto pIter = std::partition(beginIter, endIter,
-		[&](const Primitive& p) { return GetCentroid(bound(p))[dim] < mid; });
-
-	return std::distance(primitives.begin(), pIter);
+	return ParallelPartition(refs, beginId, endId, kSplitGrain,
+		[&](const PrimitiveRef& r) { return r.centroid[dim] < mid; });
 }
-#else
+
 // Split Method: EqualCounts
 // Partition primitives into equally-sized subsets
-int PrimitiveSplit::operator() (std::vector<Primitive>& primitives, int beginId, int endId) const
+int PrimitiveSplit::SplitEqualCounts(std::vector<PrimitiveRef>& refs, int beginId, int endId) const
 {
-	auto beginIter = primitives.begin() + beginId;
-	auto endIter = primitives.begin() + endId;
-	Aabb cbox = Bound(); // centroid bounding box
-
-	for (auto iter = beginIter; iter != endIter; ++iter)
-		cbox = Union(cbox, bound(*iter));
+	auto beginIter = refs.begin() + beginId;
+	auto endIter = refs.begin() + endId;
+	Aabb cbox = CentroidBound(refs, beginId, endId); // centroid bounding box
 
 	int dim = GetMaxExtentDim(cbox);
 	int mid = (beginId + endId) / 2;
-	auto midIter = primitives.begin() + mid;
+	auto midIter = refs.begin() + mid;
 
 	std::nth_element(beginIter, midIter, endIter,
-		[&](const Primitive& a, const Primitive& b)
-	{ return GetCentroid(bound(a))[dim] < GetCentroid(bound(b))[dim]; });
+		[&](const PrimitiveRef& a, const PrimitiveRef& b) { return a.centroid[dim] < b.centroid[dim]; });
 
 	return mid;
 }
-#endif
 
-void PrimitiveTriangle::operator()(const Primitive& hF, vec3& v0, vec3& v1, vec3& v2) const
+// Bin of centroid c along dim among nBins buckets spanning cbox
+static inline int GetBin(const Aabb& cbox, const vec3& c, int dim, int nBins)
+{
+	int b = static_cast<int>(nBins * ((c[dim] - cbox.pMin[dim]) / (cbox.pMax[dim] - cbox.pMin[dim])));
+	return std::min(std::max(b, 0), nBins - 1);
+}
+
+// Bin centroids along each axis and find the bucket boundary minimizing
+// A(L) * N(L) + A(R) * N(R)
+SahSplit PrimitiveSplit::FindSah(const std::vector<PrimitiveRef>& refs, int beginId, int endId) const
+{
+	struct Bin
+	{
+		Aabb bbox = Bound();
+		int count = 0;
+	};
+
+	SahSplit sah;
+	int numChunks = GetNumChunks(beginId, endId, kSplitGrain);
+	std::vector<Aabb> bboxes(numChunks, Bound()); // node bounding box
+	std::vector<Aabb> cboxes(numChunks, Bound()); // centroid bounding box
+
+	ParallelFor(beginId, endId, kSplitGrain, [&](int b, int e)
+	{
+		int chunk = (b - beginId) / kSplitGrain;
+		for (int i = b; i < e; ++i)
+		{
+			bboxes[chunk] = Union(bboxes[chunk], refs[i].bbox);
+			cboxes[chunk] = Union(cboxes[chunk], Bound(refs[i].centroid));
+		}
+	});
+
+	for (int chunk = 0; chunk < numChunks; ++chunk)
+	{
+		sah.bbox = Union(sah.bbox, bboxes[chunk]);
+		sah.cbox = Union(sah.cbox, cboxes[chunk]);
+	}
+
+	// All centroids coincide, no plane can separate them
+	if (GetMaxExtentVal(sah.cbox) <= 0.f)
+		return sah;
+
+	const int nBins = std::max(numBins, 2);
+	const Aabb& cbox = sah.cbox;
+	vec3 extent = GetDiagonal(cbox);
+
+	// Bins of each chunk are filled independently then merged
+	std::vector<Bin> chunkBins(numChunks * 3 * nBins);
+
+	ParallelFor(beginId, endId, kSplitGrain, [&](int b, int e)
+	{
+		Bin* bins = &chunkBins[(b - beginId) / kSplitGrain * 3 * nBins];
+		for (int i = b; i < e; ++i)
+		{
+			for (int dim = 0; dim < 3; ++dim)
+			{
+				if (extent[dim] <= 0.f) continue;
+				Bin& bin = bins[dim * nBins + GetBin(cbox, refs[i].centroid, dim, nBins)];
+				bin.bbox = Union(bin.bbox, refs[i].bbox);
+				++bin.count;
+			}
+		}
+	});
+
+	std::vector<Bin> bins(3 * nBins);
+	for (int chunk = 0; chunk < numChunks; ++chunk)
+	{
+		for (int i = 0; i < 3 * nBins; ++i)
+		{
+			const Bin& bin = chunkBins[chunk * 3 * nBins + i];
+			bins[i].bbox = Union(bins[i].bbox, bin.bbox);
+			bins[i].count += bin.count;
+		}
+	}
+
+	// Sweep from right to left to accumulate right-side area * count,
+	// then from left to right to evaluate each candidate boundary
+	std::vector<float> rightCost(nBins);
+	std::vector<Aabb> rightBox(nBins);
+
+	for (int dim = 0; dim < 3; ++dim)
+	{
+		if (extent[dim] <= 0.f) continue;
+		const Bin* dimBins = &bins[dim * nBins];
+
+		Aabb rbox = Bound();
+		int rcount = 0;
+		for (int i = nBins - 1; i > 0; --i)
+		{
+			rbox = Union(rbox, dimBins[i].bbox);
+			rcount += dimBins[i].count;
+			rightCost[i] = rcount ? GetArea(rbox) * rcount : 0.f;
+			rightBox[i] = rbox;
+		}
+
+		Aabb lbox = Bound();
+		int lcount = 0;
+		for (int i = 0; i < nBins - 1; ++i)
+		{
+			lbox = Union(lbox, dimBins[i].bbox);
+			lcount += dimBins[i].count;
+			if (lcount == 0 || lcount == endId - beginId) continue;
+
+			float cost = GetArea(lbox) * lcount + rightCost[i + 1];
+			if (cost < sah.cost)
+			{
+				sah.cost = cost;
+				sah.dim = dim;
+				sah.bin = i;
+				sah.lbox = lbox;
+				sah.rbox = rightBox[i + 1];
+			}
+		}
+	}
+
+	return sah;
+}
+
+// Split Method: SAH
+// Partition at the binned SAH boundary minimizing
+// Ct + Ci * (A(L) * N(L) + A(R) * N(R)) / A(node)
+int PrimitiveSplit::SplitSah(std::vector<PrimitiveRef>& refs, int beginId, int endId) const
 {
-	HalfedgeHandle hH = mesh.halfedge_handle(hF);
-	VertexHandle hV0 = mesh.to_vertex_handle(hH);
-	hH = mesh.next_halfedge_handle(hH);
-	VertexHandle hV1 = mesh.to_vertex_handle(hH);
-	hH = mesh.next_halfedge_handle(hH);
-	VertexHandle hV2 = mesh.to_vertex_handle(hH);
+	SahSplit sah = FindSah(refs, beginId, endId);
 
-	Point p0 = mesh.point(hV0);
-	Point p1 = mesh.point(hV1);
-	Point p2 = mesh.point(hV2);
+	if (sah.dim < 0)
+		return SplitEqualCounts(refs, beginId, endId);
 
-	v0 = { p0[0], p0[1], p0[2] };
-	v1 = { p1[0], p1[1], p1[2] };
-	v2 = { p2[0], p2[1], p2[2] };
+	float area = GetArea(sah.bbox);
+	float leafCost = costIntersect * (endId - beginId);
+	float splitCost = costTraversal + costIntersect * (area > 0.f ? sah.cost / area : 0.f);
+
+	// Intersecting all primitives is cheaper than traversing children
+	if ((endId - beginId) <= maxLeafSize && leafCost <= splitCost)
+		return beginId;
+
+	const int nBins = std::max(numBins, 2);
+
+	return ParallelPartition(refs, beginId, endId, kSplitGrain,
+		[&](const PrimitiveRef& r) { return GetBin(sah.cbox, r.centroid, sah.dim, nBins) <= sah.bin; });
 }
 
 bool PrimitiveCollide::operator()(const Primitive& primitive, const vec3& org, const vec3& dir, float& dist) const
@@ -153,18 +296,97 @@ bool PrimitiveCollide::operator()(const Primitive& primitive, const vec3& org, c
 	return hit;
 }
 
-void Bvh::Build(
+bool PrimitiveHit::operator()(const Primitive& primitive, const vec3& org, const vec3& dir, float& dist) const
+{
+	vec3 v0, v1, v2;
+	float u, v;
+	triangle(primitive, v0, v1, v2);
+	if (!IsIntersecting(v0, v1, v2, org, dir, tmin, dist, u, v, culling)) return false;
+
+	hit = { primitive.idx(), dist, u, v };
+	return true;
+}
+
+bool PrimitiveOcclude::operator()(const Primitive& primitive, const vec3& org, const vec3& dir, float tmax) const
+{
+	vec3 v0, v1, v2;
+	triangle(primitive, v0, v1, v2);
+	return IsIntersecting(v0, v1, v2, org, dir, tmax, culling);
+}
+
+void Bvh::PrepareRefs(
+	const std::vector<Primitive>& primitives,
+	const PrimitiveBound& bound)
+{
+	int n = static_cast<int>(primitives.size());
+	mRefs.resize(n);
+
+	// Refit data of a previous tree is stale
+	mParents.clear();
+
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			PrimitiveRef& ref = mRefs[i];
+			ref.bbox = bound(primitives[i]);
+			ref.centroid = GetCentroid(ref.bbox);
+			ref.id = i;
+		}
+	});
+}
+
+void Bvh::ReleaseRefs(const std::vector<Primitive>& primitives)
+{
+	int n = static_cast<int>(mRefs.size());
+	mPrimitives.resize(n);
+
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+			mPrimitives[i] = primitives[mRefs[i].id];
+	});
+
+	mRefs.clear();
+	mRefs.shrink_to_fit();
+}
+
+float Bvh::Build(
 	const std::vector<Primitive>& primitives,
 	const PrimitiveBound& bound,
 	const PrimitiveSplit& split,
 	int numObjPerNode)
 {
-	std::copy(primitives.begin(), primitives.end(), std::back_inserter(mPrimitives));
+	PrepareRefs(primitives, bound);
 
+	// A binary tree with at least one primitive per leaf has at most 2n - 1 nodes
 	mThreshold = numObjPerNode;
-	mNodes.emplace_back();
+	mNodes.assign(std::max(2 * static_cast<int>(mRefs.size()) - 1, 1), BvhNode());
+	mNumNodes = 1;
+
+	BuildRecursive(0, mRefs.size(), 0, 0, split);
+	mNodes.resize(mNumNodes);
+
+	ReleaseRefs(primitives);
+
+	return GetSahCost(split.costTraversal, split.costIntersect);
+}
+
+float Bvh::GetSahCost(float costTraversal, float costIntersect) const
+{
+	if (mNodes.empty()) return 0.f;
+
+	float rootArea = GetArea(mNodes[0].bbox);
+	if (rootArea <= 0.f) return 0.f;
+
+	float cost = 0.f;
+	for (const BvhNode& node : mNodes)
+	{
+		float ratio = GetArea(node.bbox) / rootArea;
+		cost += ratio * (IsLeaf(node) ? costIntersect * Length(node) : costTraversal);
+	}
 
-	BuildRecursive(0, mPrimitives.size(), 0, 0, bound, split);
+	return cost;
 }
 
 void Bvh::BuildRecursive(
@@ -172,7 +394,6 @@ void Bvh::BuildRecursive(
 	int endId,
 	int nodeId,
 	int depth,
-	const PrimitiveBound& bound,
 	const PrimitiveSplit& split)
 {
 	if ((endId - beginId) <= mThreshold)
@@ -180,13 +401,13 @@ void Bvh::BuildRecursive(
 		SetLeaf(mNodes[nodeId], beginId, endId - beginId);
 		Aabb bbox = Bound();
 		for (int i = beginId; i < endId; ++i)
-			bbox = Union(bbox, bound(mPrimitives[i]));
+			bbox = Union(bbox, mRefs[i].bbox);
 		mNodes[nodeId].bbox = bbox;
 	}
 	else
 	{
 		// Split primitives into left and right children nodes at splitting index
-		int splitId = split(mPrimitives, beginId, endId);
+		int splitId = split(mRefs, beginId, endId);
 
 		// Make leaf node if it failed to split primitives into 2 sets
 		if (splitId == beginId || splitId == endId)
@@ -194,97 +415,1988 @@ void Bvh::BuildRecursive(
 			SetLeaf(mNodes[nodeId], beginId, endId - beginId);
 			Aabb bbox = Bound();
 			for (int i = beginId; i < endId; ++i)
-				bbox = Union(bbox, bound(mPrimitives[i]));
+				bbox = Union(bbox, mRefs[i].bbox);
 			mNodes[nodeId].bbox = bbox;
 		}
 		// Build Bvh recursively after splitting primitives
 		else
 		{
-			mNodes[nodeId].bbox = Bound();
-
-			int left = static_cast<int>(mNodes.size());
+			// Children are allocated in pairs so that concurrent subtrees
+			// never write to the same slots of the node array
+			int left = mNumNodes.fetch_add(2);
+			int right = left + 1;
 			Left(mNodes[nodeId]) = left;
-			mNodes.emplace_back();
-
-			BuildRecursive(beginId, splitId, left, depth + 1, bound, split);
-			mNodes[nodeId].bbox = Union(mNodes[nodeId].bbox, mNodes[left].bbox);
-
-			int right = static_cast<int>(mNodes.size());
 			Right(mNodes[nodeId]) = right;
-			mNodes.emplace_back();
 
-			BuildRecursive(splitId, endId, right, depth + 1, bound, split);
-			mNodes[nodeId].bbox = Union(mNodes[nodeId].bbox, mNodes[right].bbox);
+			if ((endId - beginId) >= kParallelBuildSize)
+			{
+				TaskGroup group;
+				group.Run([&]() { BuildRecursive(beginId, splitId, left, depth + 1, split); });
+				BuildRecursive(splitId, endId, right, depth + 1, split);
+				group.Wait();
+			}
+			else
+			{
+				BuildRecursive(beginId, splitId, left, depth + 1, split);
+				BuildRecursive(splitId, endId, right, depth + 1, split);
+			}
+
+			mNodes[nodeId].bbox = Union(mNodes[left].bbox, mNodes[right].bbox);
 		}
 	}
 }
 
-bool Bvh::Intersect(
-	const PrimitiveCollide& collide,
-	const vec3& org,
-	const vec3& dir,
-	float& dist) const
+// Spread the lower 10 bits of v so that there are 2 zero bits between each
+static inline uint64_t ExpandBits10(uint64_t v)
 {
-	bool hit = false;
-	std::stack<int> recursive;
-	int curr = 0;
-	vec3 invDir = { 1.f / dir.x, 1.f / dir.y, 1.f / dir.z };
-	int3 isNeg = { dir.x < 0, dir.y < 0, dir.z < 0 };
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x30000ff;
+	v = (v | (v <<  8)) & 0x300f00f;
+	v = (v | (v <<  4)) & 0x30c30c3;
+	v = (v | (v <<  2)) & 0x9249249;
+	return v;
+}
 
-	// _DEBUG
-	int numIntersectBox = 0;
-	int numIntersectPri = 0;
+// Spread the lower 21 bits of v so that there are 2 zero bits between each
+static inline uint64_t ExpandBits21(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffull;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+	v = (v | (v <<  8)) & 0x100f00f00f00f00full;
+	v = (v | (v <<  4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v <<  2)) & 0x1249249249249249ull;
+	return v;
+}
 
-	while (true)
+// Morton code of a point given in [0, 1]^3
+static inline uint64_t EncodeMorton(const vec3& p, int mortonBits)
+{
+	if (mortonBits > 30)
 	{
-		const BvhNode& node = mNodes[curr]; // safe
+		auto q = [](float x) { return static_cast<uint64_t>(std::min(std::max(x * 2097152.f, 0.f), 2097151.f)); };
+		return (ExpandBits21(q(p.x)) << 2) | (ExpandBits21(q(p.y)) << 1) | ExpandBits21(q(p.z));
+	}
+	else
+	{
+		auto q = [](float x) { return static_cast<uint64_t>(std::min(std::max(x * 1024.f, 0.f), 1023.f)); };
+		return (ExpandBits10(q(p.x)) << 2) | (ExpandBits10(q(p.y)) << 1) | ExpandBits10(q(p.z));
+	}
+}
+
+static inline int CountLeadingZeros(uint64_t v)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	return _BitScanReverse64(&index, v) ? 63 - static_cast<int>(index) : 64;
+#else
+	return v ? __builtin_clzll(v) : 64;
+#endif
+}
+
+void Bvh::SortRefsByMorton(int mortonBits, std::vector<uint64_t>& codes)
+{
+	int n = static_cast<int>(mRefs.size());
 
-		//if (++numIntersectBox && IsIntersecting(curr->bbox, org, dir, dist))
-		if (++numIntersectBox && IsIntersecting(node.bbox, org, invDir, dist, true))
+	// Centroid bounding box of all primitives
+	Aabb cbox = CentroidBound(mRefs, 0, n);
+
+	// Morton codes sorted along with primitive indices
+	std::vector<int> order(n);
+	codes.resize(n);
+
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
 		{
-			draw_aabb(node.bbox); // _DEBUG
+			codes[i] = EncodeMorton(GetOffset(cbox, mRefs[i].centroid), mortonBits);
+			order[i] = i;
+		}
+	});
 
-			if (IsLeaf(node))
+	ParallelRadixSort(codes, order, (mortonBits > 30) ? 63 : 30);
+
+	std::vector<PrimitiveRef> sorted(n);
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+			sorted[i] = mRefs[order[i]];
+	});
+	mRefs.swap(sorted);
+}
+
+float Bvh::BuildLinear(
+	const std::vector<Primitive>& primitives,
+	const PrimitiveBound& bound,
+	int mortonBits)
+{
+	int n = static_cast<int>(primitives.size());
+	mThreshold = 1;
+	mPrimitives.clear();
+	mNodes.clear();
+	if (n == 0) return 0.f;
+
+	PrepareRefs(primitives, bound);
+
+	std::vector<uint64_t> codes;
+	SortRefsByMorton(mortonBits, codes);
+
+	// Inner nodes take [0, n - 1) and leaves take [n - 1, 2n - 1) so that
+	// the root lands at 0 (Karras, Maximizing parallelism in the
+	// construction of BVHs, octrees, and k-d trees)
+	const int leafBase = n - 1;
+	mNodes.assign(2 * n - 1, BvhNode());
+	std::vector<int> parents(2 * n - 1, -1);
+
+	// Length of the common prefix of codes i and j; ties among equal codes
+	// are broken by their indices
+	auto delta = [&](int i, int j)
+	{
+		if (j < 0 || j >= n) return -1;
+		uint64_t x = codes[i] ^ codes[j];
+		if (x) return CountLeadingZeros(x);
+		return 64 + CountLeadingZeros(static_cast<uint64_t>(i ^ j)) - 32;
+	};
+
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int j = b; j < e; ++j)
+			SetLeaf(mNodes[leafBase + j], j, 1);
+	});
+
+	ParallelFor(0, n - 1, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			// Direction of the range covered by node i
+			int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+
+			// Upper bound of the range length then binary search the other end
+			int deltaMin = delta(i, i - d);
+			int lMax = 2;
+			while (delta(i, i + lMax * d) > deltaMin)
+				lMax *= 2;
+
+			int l = 0;
+			for (int t = lMax / 2; t >= 1; t /= 2)
+				if (delta(i, i + (l + t) * d) > deltaMin)
+					l += t;
+			int j = i + l * d;
+
+			// Binary search the split position within the range
+			int deltaNode = delta(i, j);
+			int s = 0;
+			for (int t = (l + 1) / 2; ; t = (t + 1) / 2)
 			{
-				int beginId = Offset(node);
-				int endId = Offset(node) + Length(node);
+				if (delta(i, i + (s + t) * d) > deltaNode)
+					s += t;
+				if (t == 1) break;
+			}
+			int gamma = i + s * d + std::min(d, 0);
 
-				for (int i = beginId; i < endId; ++i)
-					if (++numIntersectPri && collide(mPrimitives[i], org, dir, dist))
-						hit = true;
+			int left = (std::min(i, j) == gamma) ? leafBase + gamma : gamma;
+			int right = (std::max(i, j) == gamma + 1) ? leafBase + gamma + 1 : gamma + 1;
+
+			Left(mNodes[i]) = left;
+			Right(mNodes[i]) = right;
+			parents[left] = i;
+			parents[right] = i;
+		}
+	});
+
+	// Bottom-up bounding boxes: the second child to arrive at a parent
+	// merges both boxes and carries on upwards
+	std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[n]);
+	for (int i = 0; i < n; ++i)
+		visits[i] = 0;
 
-				if (recursive.empty()) break;
-				curr = recursive.top();
-				recursive.pop();
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int j = b; j < e; ++j)
+		{
+			int nodeId = leafBase + j;
+			mNodes[nodeId].bbox = mRefs[j].bbox;
+
+			for (int p = parents[nodeId]; p >= 0; p = parents[p])
+			{
+				if (visits[p].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+				BvhNode& parent = mNodes[p];
+				parent.bbox = Union(mNodes[Left(parent)].bbox, mNodes[Right(parent)].bbox);
 			}
-			else
+		}
+	});
+
+	ReleaseRefs(primitives);
+
+	return GetSahCost();
+}
+
+float Bvh::BuildPloc(
+	const std::vector<Primitive>& primitives,
+	const PrimitiveBound& bound,
+	int radius,
+	int mortonBits)
+{
+	int n = static_cast<int>(primitives.size());
+	mThreshold = 1;
+	mPrimitives.clear();
+	mNodes.clear();
+	if (n == 0) return 0.f;
+
+	PrepareRefs(primitives, bound);
+
+	std::vector<uint64_t> codes;
+	SortRefsByMorton(mortonBits, codes);
+
+	// Nodes are created in merge order: leaves first, root last
+	std::vector<BvhNode> nodes(2 * n - 1);
+	std::vector<int> clusters(n), nearest(n), merged(n);
+	int numNodes = n;
+
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			SetLeaf(nodes[i], i, 1);
+			nodes[i].bbox = mRefs[i].bbox;
+			clusters[i] = i;
+		}
+	});
+
+	radius = std::max(radius, 1);
+
+	for (int numClusters = n; numClusters > 1; )
+	{
+		// Nearest neighbor of every cluster within the search radius, by
+		// area of their union; ties go to the lower index so that a pair
+		// of mutual nearest neighbors always exists
+		ParallelFor(0, numClusters, kLinearGrain, [&](int b, int e)
+		{
+			for (int i = b; i < e; ++i)
 			{
-				int dim = GetMaxExtentDim(node.bbox);
-				
-				if (isNeg[dim])
+				const Aabb& box = nodes[clusters[i]].bbox;
+				float bestArea = FLT_MAX;
+				int best = i + 1 < numClusters ? i + 1 : i - 1;
+
+				for (int j = std::max(i - radius, 0); j <= std::min(i + radius, numClusters - 1); ++j)
 				{
-					recursive.push(Left(node));
-					curr = Right(node);
+					if (j == i) continue;
+					float area = GetArea(Union(box, nodes[clusters[j]].bbox));
+					if (area < bestArea)
+					{
+						bestArea = area;
+						best = j;
+					}
 				}
-				else
+
+				nearest[i] = best;
+			}
+		});
+
+		// Mutual nearest neighbors merge; the lower one of each pair
+		// allocates the new node
+		ParallelFor(0, numClusters, kLinearGrain, [&](int b, int e)
+		{
+			for (int i = b; i < e; ++i)
+				merged[i] = (nearest[nearest[i]] == i && i < nearest[i]) ? 1 : 0;
+		});
+
+		int numMerged = 0;
+		for (int i = 0; i < numClusters; ++i)
+		{
+			int flag = merged[i];
+			merged[i] = numNodes + numMerged;
+			numMerged += flag;
+		}
+
+		// Infinite or NaN areas can leave no mutual pair; merge the first
+		// two clusters so that every pass makes progress
+		if (numMerged == 0)
+		{
+			nearest[0] = 1;
+			nearest[1] = 0;
+			numMerged = 1;
+		}
+
+		ParallelFor(0, numClusters, kLinearGrain, [&](int b, int e)
+		{
+			for (int i = b; i < e; ++i)
+			{
+				int j = nearest[i];
+				if (nearest[j] != i) continue;
+
+				if (i < j)
 				{
-					recursive.push(Right(node));
-					curr = Left(node);
+					BvhNode& node = nodes[merged[i]];
+					Left(node) = clusters[i];
+					Right(node) = clusters[j];
+					node.bbox = Union(nodes[clusters[i]].bbox, nodes[clusters[j]].bbox);
 				}
 			}
-		}
-		else
+		});
+
+		ParallelFor(0, numClusters, kLinearGrain, [&](int b, int e)
+		{
+			for (int i = b; i < e; ++i)
+			{
+				int j = nearest[i];
+				if (nearest[j] == i)
+					clusters[i] = (i < j) ? merged[i] : -1;
+			}
+		});
+
+		numNodes += numMerged;
+		numClusters = ParallelPartition(clusters, 0, numClusters, kLinearGrain,
+			[](int c) { return c >= 0; });
+	}
+
+	// Lay the tree out again from the root so that it lands at 0
+	mNodes.resize(2 * n - 1);
+	mNodes[0] = nodes[clusters[0]];
+	int next = 1;
+	std::vector<int> stack(1, 0);
+
+	while (!stack.empty())
+	{
+		BvhNode& node = mNodes[stack.back()];
+		stack.pop_back();
+		if (IsLeaf(node)) continue;
+
+		int left = next, right = next + 1;
+		next += 2;
+		mNodes[left] = nodes[Left(node)];
+		mNodes[right] = nodes[Right(node)];
+		Left(node) = left;
+		Right(node) = right;
+		stack.push_back(right);
+		stack.push_back(left);
+	}
+
+	ReleaseRefs(primitives);
+
+	return GetSahCost();
+}
+
+// Bounds of the part of triangle v[0..2] within lo <= x[dim] <= hi
+static Aabb ClipTriangle(const vec3 v[3], int dim, float lo, float hi)
+{
+	Aabb box = Bound();
+
+	for (int i = 0; i < 3; ++i)
+	{
+		const vec3& a = v[i];
+		const vec3& b = v[(i + 1) % 3];
+
+		if (a[dim] >= lo && a[dim] <= hi)
+			box = Union(box, Bound(a));
+
+		// Edge crossing the slab boundaries
+		for (float plane : { lo, hi })
 		{
-			if (recursive.empty()) break;
-			curr = recursive.top();
-			recursive.pop();
+			if ((a[dim] < plane && b[dim] > plane) || (a[dim] > plane && b[dim] < plane))
+			{
+				vec3 q = a + (b - a) * ((plane - a[dim]) / (b[dim] - a[dim]));
+				q[dim] = plane;
+				box = Union(box, Bound(q));
+			}
 		}
 	}
 
-	// _DEBUG
-	printf("Number of AABB intersecting test = %d\n", numIntersectBox);
-	printf("Number of Primitive intersecting test = %d\n", numIntersectPri);
-	printf("Intersecting test result = %d\n", hit);
+	return box;
+}
 
-	return hit;
+// State shared by all nodes of a spatial split build
+struct SpatialBuild
+{
+	const std::vector<Primitive>& primitives;
+	const PrimitiveTriangle& triangle;
+	const PrimitiveSplit& split;
+	float rootArea;
+	int numRefs; // references in the tree so far, including duplicates
+	int maxRefs; // duplication budget
+};
+
+// Part of a reference on either side of a plane
+static void SplitReference(
+	const SpatialBuild& ctx,
+	const PrimitiveRef& ref,
+	int dim,
+	float pos,
+	PrimitiveRef& left,
+	PrimitiveRef& right)
+{
+	vec3 v[3];
+	ctx.triangle(ctx.primitives[ref.id], v[0], v[1], v[2]);
+
+	left = right = ref;
+	left.bbox = Intersect(ClipTriangle(v, dim, -FLT_MAX, pos), ref.bbox);
+	right.bbox = Intersect(ClipTriangle(v, dim, pos, FLT_MAX), ref.bbox);
+	left.bbox.pMax[dim] = std::min(left.bbox.pMax[dim], pos);
+	right.bbox.pMin[dim] = std::max(right.bbox.pMin[dim], pos);
+	left.centroid = GetCentroid(left.bbox);
+	right.centroid = GetCentroid(right.bbox);
+}
+
+// Best spatial split of references in bbox: chop every reference at the
+// bin planes it spans, so that bins hold clipped bounds. Returns false if
+// no plane separates them.
+static bool FindSpatialSplit(
+	const SpatialBuild& ctx,
+	const std::vector<PrimitiveRef>& refs,
+	const Aabb& bbox,
+	int& bestDim,
+	float& bestPos,
+	float& bestCost)
+{
+	struct Bin
+	{
+		Aabb bbox = Bound();
+		int entries = 0;
+		int exits = 0;
+	};
+
+	const int nBins = std::max(ctx.split.numBins, 2);
+	vec3 extent = GetDiagonal(bbox);
+	std::vector<Bin> bins(nBins);
+	std::vector<float> rightCost(nBins);
+	bestDim = -1;
+	bestCost = FLT_MAX;
+
+	for (int dim = 0; dim < 3; ++dim)
+	{
+		if (extent[dim] <= 0.f) continue;
+
+		float binWidth = extent[dim] / nBins;
+		auto binOf = [&](float x)
+		{
+			int b = static_cast<int>((x - bbox.pMin[dim]) / binWidth);
+			return std::min(std::max(b, 0), nBins - 1);
+		};
+
+		std::fill(bins.begin(), bins.end(), Bin());
+
+		for (const PrimitiveRef& ref : refs)
+		{
+			int first = binOf(ref.bbox.pMin[dim]);
+			int last = binOf(ref.bbox.pMax[dim]);
+
+			if (first == last)
+			{
+				bins[first].bbox = Union(bins[first].bbox, ref.bbox);
+			}
+			else
+			{
+				vec3 v[3];
+				ctx.triangle(ctx.primitives[ref.id], v[0], v[1], v[2]);
+
+				for (int b = first; b <= last; ++b)
+				{
+					float lo = bbox.pMin[dim] + binWidth * b;
+					float hi = (b == nBins - 1) ? bbox.pMax[dim] : lo + binWidth;
+					Aabb part = Intersect(ClipTriangle(v, dim, lo, hi), ref.bbox);
+					if (IsValid(part))
+						bins[b].bbox = Union(bins[b].bbox, part);
+				}
+			}
+
+			++bins[first].entries;
+			++bins[last].exits;
+		}
+
+		Aabb rbox = Bound();
+		int rcount = 0;
+		for (int i = nBins - 1; i > 0; --i)
+		{
+			rbox = Union(rbox, bins[i].bbox);
+			rcount += bins[i].exits;
+			rightCost[i] = rcount ? GetArea(rbox) * rcount : 0.f;
+		}
+
+		Aabb lbox = Bound();
+		int lcount = 0;
+		for (int i = 0; i < nBins - 1; ++i)
+		{
+			lbox = Union(lbox, bins[i].bbox);
+			lcount += bins[i].entries;
+			if (lcount == 0 || rightCost[i + 1] == 0.f) continue;
+
+			float cost = GetArea(lbox) * lcount + rightCost[i + 1];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestDim = dim;
+				bestPos = bbox.pMin[dim] + binWidth * (i + 1);
+			}
+		}
+	}
+
+	return bestDim >= 0;
+}
+
+float Bvh::BuildSpatial(
+	const std::vector<Primitive>& primitives,
+	const PrimitiveBound& bound,
+	const PrimitiveTriangle& triangle,
+	const PrimitiveSplit& split,
+	float maxDuplication,
+	int numObjPerNode)
+{
+	int n = static_cast<int>(primitives.size());
+	mThreshold = numObjPerNode;
+	mPrimitives.clear();
+	mNodes.clear();
+	if (n == 0) return 0.f;
+
+	PrepareRefs(primitives, bound);
+
+	Aabb rootBox = Bound();
+	for (const PrimitiveRef& ref : mRefs)
+		rootBox = Union(rootBox, ref.bbox);
+
+	SpatialBuild ctx = { primitives, triangle, split, GetArea(rootBox), n,
+		static_cast<int>(n * (1.f + std::max(maxDuplication, 0.f))) };
+
+	std::vector<PrimitiveRef> refs;
+	refs.swap(mRefs);
+
+	mNodes.reserve(2 * ctx.maxRefs);
+	mPrimitives.reserve(ctx.maxRefs);
+	mNodes.emplace_back();
+
+	BuildSpatialRecursive(ctx, refs, 0, 0);
+
+	return GetSahCost(split.costTraversal, split.costIntersect);
+}
+
+void Bvh::BuildSpatialRecursive(
+	SpatialBuild& ctx,
+	std::vector<PrimitiveRef>& refs,
+	int nodeId,
+	int depth)
+{
+	const PrimitiveSplit& split = ctx.split;
+	int n = static_cast<int>(refs.size());
+
+	auto makeLeaf = [&]()
+	{
+		Aabb bbox = Bound();
+		SetLeaf(mNodes[nodeId], static_cast<int>(mPrimitives.size()), n);
+		for (const PrimitiveRef& ref : refs)
+		{
+			bbox = Union(bbox, ref.bbox);
+			mPrimitives.push_back(ctx.primitives[ref.id]);
+		}
+		mNodes[nodeId].bbox = bbox;
+	};
+
+	if (n <= mThreshold || depth >= kSpatialMaxDepth)
+	{
+		makeLeaf();
+		return;
+	}
+
+	// Object split candidate
+	SahSplit sah = split.FindSah(refs, 0, n);
+	float area = GetArea(sah.bbox);
+
+	// Spatial split candidate, worth trying only if object split children
+	// overlap noticeably and the duplication budget is not used up
+	int spatialDim = -1;
+	float spatialPos = 0.f;
+	float spatialCost = FLT_MAX;
+
+	if (ctx.numRefs < ctx.maxRefs)
+	{
+		Aabb overlap = ::Intersect(sah.lbox, sah.rbox);
+		if (sah.dim < 0 || (IsValid(overlap) && GetArea(overlap) > kSpatialSplitAlpha * ctx.rootArea))
+			FindSpatialSplit(ctx, refs, sah.bbox, spatialDim, spatialPos, spatialCost);
+	}
+
+	float bestCost = std::min(sah.cost, spatialCost);
+	float leafCost = split.costIntersect * n;
+	float splitCost = split.costTraversal + split.costIntersect * (area > 0.f ? bestCost / area : 0.f);
+
+	// Intersecting all primitives is cheaper than traversing children
+	if (n <= split.maxLeafSize && leafCost <= splitCost)
+	{
+		makeLeaf();
+		return;
+	}
+
+	std::vector<PrimitiveRef> left, right;
+
+	if (spatialDim >= 0 && spatialCost < sah.cost)
+	{
+		int dim = spatialDim;
+		float pos = spatialPos;
+		Aabb lbox = Bound(), rbox = Bound();
+		std::vector<PrimitiveRef> straddling;
+
+		for (const PrimitiveRef& ref : refs)
+		{
+			if (ref.bbox.pMax[dim] <= pos)
+			{
+				left.push_back(ref);
+				lbox = Union(lbox, ref.bbox);
+			}
+			else if (ref.bbox.pMin[dim] >= pos)
+			{
+				right.push_back(ref);
+				rbox = Union(rbox, ref.bbox);
+			}
+			else
+			{
+				straddling.push_back(ref);
+			}
+		}
+
+		// Reference unsplitting: keep a straddling reference whole on one
+		// side when that is cheaper than duplicating it, or when out of budget
+		for (const PrimitiveRef& ref : straddling)
+		{
+			PrimitiveRef lref, rref;
+			SplitReference(ctx, ref, dim, pos, lref, rref);
+
+			float nl = static_cast<float>(left.size());
+			float nr = static_cast<float>(right.size());
+			bool canSplit = ctx.numRefs < ctx.maxRefs && IsValid(lref.bbox) && IsValid(rref.bbox);
+
+			float costSplit = canSplit ?
+				GetArea(Union(lbox, lref.bbox)) * (nl + 1) + GetArea(Union(rbox, rref.bbox)) * (nr + 1) : FLT_MAX;
+			float costLeft = GetArea(Union(lbox, ref.bbox)) * (nl + 1) + GetArea(rbox) * nr;
+			float costRight = GetArea(lbox) * nl + GetArea(Union(rbox, ref.bbox)) * (nr + 1);
+
+			if (costSplit < costLeft && costSplit < costRight)
+			{
+				left.push_back(lref);
+				right.push_back(rref);
+				lbox = Union(lbox, lref.bbox);
+				rbox = Union(rbox, rref.bbox);
+				++ctx.numRefs;
+			}
+			else if (costLeft <= costRight)
+			{
+				left.push_back(ref);
+				lbox = Union(lbox, ref.bbox);
+			}
+			else
+			{
+				right.push_back(ref);
+				rbox = Union(rbox, ref.bbox);
+			}
+		}
+	}
+
+	// Object split, or the spatial split put everything on one side
+	if (left.empty() || right.empty())
+	{
+		left.clear();
+		right.clear();
+
+		int splitId = (sah.dim >= 0) ?
+			static_cast<int>(std::partition(refs.begin(), refs.end(), [&](const PrimitiveRef& r)
+				{ return GetBin(sah.cbox, r.centroid, sah.dim, std::max(split.numBins, 2)) <= sah.bin; }) - refs.begin()) :
+			split(refs, 0, n);
+
+		if (splitId == 0 || splitId == n)
+		{
+			makeLeaf();
+			return;
+		}
+
+		left.assign(refs.begin(), refs.begin() + splitId);
+		right.assign(refs.begin() + splitId, refs.end());
+	}
+
+	// Children are built from their own reference lists
+	std::vector<PrimitiveRef>().swap(refs);
+
+	int leftId = static_cast<int>(mNodes.size());
+	int rightId = leftId + 1;
+	Left(mNodes[nodeId]) = leftId;
+	Right(mNodes[nodeId]) = rightId;
+	mNodes.emplace_back();
+	mNodes.emplace_back();
+
+	BuildSpatialRecursive(ctx, left, leftId, depth + 1);
+	BuildSpatialRecursive(ctx, right, rightId, depth + 1);
+
+	mNodes[nodeId].bbox = Union(mNodes[leftId].bbox, mNodes[rightId].bbox);
+}
+
+void Bvh::PrepareRefit()
+{
+	int numNodes = static_cast<int>(mNodes.size());
+	int numSlots = static_cast<int>(mPrimitives.size());
+	mParents.assign(numNodes, -1);
+	mLevels.assign(numNodes, 0);
+	mPrimLeaves.assign(numSlots, -1);
+
+	// Breadth first order groups nodes of equal depth together
+	mLevelNodes.clear();
+	mLevelOffsets.clear();
+	if (numNodes == 0) return;
+
+	mLevelNodes.push_back(0);
+	mLevelOffsets.push_back(0);
+
+	for (size_t i = 0; i < mLevelNodes.size(); ++i)
+	{
+		int nodeId = mLevelNodes[i];
+		const BvhNode& node = mNodes[nodeId];
+
+		if (mLevels[nodeId] + 1 > static_cast<int>(mLevelOffsets.size()))
+			mLevelOffsets.push_back(static_cast<int>(i));
+
+		if (IsLeaf(node))
+		{
+			for (int slot = Offset(node); slot < Offset(node) + Length(node); ++slot)
+				mPrimLeaves[slot] = nodeId;
+		}
+		else
+		{
+			for (int child : { Left(node), Right(node) })
+			{
+				mParents[child] = nodeId;
+				mLevels[child] = mLevels[nodeId] + 1;
+				mLevelNodes.push_back(child);
+			}
+		}
+	}
+
+	mLevelOffsets.push_back(static_cast<int>(mLevelNodes.size()));
+
+	// Slots of each face, a face may appear in several leaves of an SBVH
+	int numFaces = 0;
+	for (const Primitive& p : mPrimitives)
+		numFaces = std::max(numFaces, p.idx() + 1);
+
+	mFaceOffsets.assign(numFaces + 1, 0);
+	for (const Primitive& p : mPrimitives)
+		++mFaceOffsets[p.idx() + 1];
+	for (int i = 0; i < numFaces; ++i)
+		mFaceOffsets[i + 1] += mFaceOffsets[i];
+
+	std::vector<int> fill(mFaceOffsets.begin(), mFaceOffsets.end() - 1);
+	mFaceSlots.resize(numSlots);
+	for (int slot = 0; slot < numSlots; ++slot)
+		mFaceSlots[fill[mPrimitives[slot].idx()]++] = slot;
+}
+
+void Bvh::RefitNode(const PrimitiveBound& bound, int nodeId)
+{
+	BvhNode& node = mNodes[nodeId];
+
+	if (IsLeaf(node))
+	{
+		Aabb bbox = Bound();
+		for (int i = Offset(node); i < Offset(node) + Length(node); ++i)
+			bbox = Union(bbox, bound(mPrimitives[i]));
+		node.bbox = bbox;
+	}
+	else
+	{
+		node.bbox = Union(mNodes[Left(node)].bbox, mNodes[Right(node)].bbox);
+	}
+}
+
+void Bvh::Refit(const PrimitiveBound& bound)
+{
+	if (mParents.size() != mNodes.size())
+		PrepareRefit();
+
+	int numLevels = static_cast<int>(mLevelOffsets.size()) - 1;
+
+	for (int level = numLevels - 1; level >= 0; --level)
+	{
+		ParallelFor(mLevelOffsets[level], mLevelOffsets[level + 1], kLinearGrain, [&](int b, int e)
+		{
+			for (int i = b; i < e; ++i)
+				RefitNode(bound, mLevelNodes[i]);
+		});
+	}
+}
+
+void Bvh::Refit(const PrimitiveBound& bound, const std::vector<Primitive>& moved)
+{
+	if (mParents.size() != mNodes.size())
+		PrepareRefit();
+
+	// Mark leaves of moved primitives and all of their ancestors
+	std::vector<char> dirty(mNodes.size(), 0);
+	std::vector<int> dirtyNodes;
+	int numFaces = static_cast<int>(mFaceOffsets.size()) - 1;
+
+	for (const Primitive& p : moved)
+	{
+		if (p.idx() < 0 || p.idx() >= numFaces) continue;
+
+		for (int i = mFaceOffsets[p.idx()]; i < mFaceOffsets[p.idx() + 1]; ++i)
+		{
+			for (int nodeId = mPrimLeaves[mFaceSlots[i]]; nodeId >= 0 && !dirty[nodeId]; nodeId = mParents[nodeId])
+			{
+				dirty[nodeId] = 1;
+				dirtyNodes.push_back(nodeId);
+			}
+		}
+	}
+
+	// Deepest first, nodes of equal depth in parallel
+	std::sort(dirtyNodes.begin(), dirtyNodes.end(),
+		[&](int a, int b) { return mLevels[a] > mLevels[b]; });
+
+	for (size_t begin = 0; begin < dirtyNodes.size(); )
+	{
+		size_t end = begin;
+		while (end < dirtyNodes.size() && mLevels[dirtyNodes[end]] == mLevels[dirtyNodes[begin]])
+			++end;
+
+		ParallelFor(static_cast<int>(begin), static_cast<int>(end), kLinearGrain, [&](int b, int e)
+		{
+			for (int i = b; i < e; ++i)
+				RefitNode(bound, dirtyNodes[i]);
+		});
+
+		begin = end;
+	}
+}
+
+bool Bvh::RotateNode(int nodeId)
+{
+	BvhNode& node = mNodes[nodeId];
+	if (IsLeaf(node)) return false;
+
+	// Swapping grandchild g of child c with the other child o leaves the
+	// node's box unchanged and turns c's box into Union(o, sibling of g)
+	float bestGain = 0.f;
+	int bestSide = -1, bestGrand = -1;
+
+	for (int side = 0; side < 2; ++side)
+	{
+		const BvhNode& child = mNodes[side ? Right(node) : Left(node)];
+		const BvhNode& other = mNodes[side ? Left(node) : Right(node)];
+		if (IsLeaf(child)) continue;
+
+		float area = GetArea(child.bbox);
+
+		for (int g = 0; g < 2; ++g)
+		{
+			const BvhNode& sibling = mNodes[g ? Left(child) : Right(child)];
+			float gain = area - GetArea(Union(other.bbox, sibling.bbox));
+
+			// Ignore gains at the level of rounding noise
+			if (gain > bestGain && gain > 1e-6f * area)
+			{
+				bestGain = gain;
+				bestSide = side;
+				bestGrand = g;
+			}
+		}
+	}
+
+	if (bestSide < 0) return false;
+
+	int& childId = bestSide ? Right(node) : Left(node);
+	int& otherId = bestSide ? Left(node) : Right(node);
+	BvhNode& child = mNodes[childId];
+	int& grandId = bestGrand ? Right(child) : Left(child);
+	int siblingId = bestGrand ? Left(child) : Right(child);
+
+	std::swap(otherId, grandId);
+	child.bbox = Union(mNodes[grandId].bbox, mNodes[siblingId].bbox);
+
+	return true;
+}
+
+float Bvh::Optimize(
+	int maxPasses,
+	float timeBudgetMs,
+	float costTraversal,
+	float costIntersect)
+{
+	auto start = std::chrono::steady_clock::now();
+	auto outOfTime = [&]()
+	{
+		return timeBudgetMs > 0.f && std::chrono::duration<float, std::milli>(
+			std::chrono::steady_clock::now() - start).count() > timeBudgetMs;
+	};
+
+	std::vector<int> order;
+	order.reserve(mNodes.size());
+
+	for (int pass = 0; pass < maxPasses && !mNodes.empty(); ++pass)
+	{
+		// Breadth first order, visited backwards so that children are
+		// optimized before their parents
+		order.assign(1, 0);
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			const BvhNode& node = mNodes[order[i]];
+			if (IsLeaf(node)) continue;
+			order.push_back(Left(node));
+			order.push_back(Right(node));
+		}
+
+		int numRotations = 0;
+		for (int i = static_cast<int>(order.size()) - 1; i >= 0; --i)
+		{
+			if ((i & 4095) == 0 && outOfTime()) break;
+			if (RotateNode(order[i])) ++numRotations;
+		}
+
+		if (numRotations == 0 || outOfTime()) break;
+	}
+
+	// Topology changed, refit data must be rebuilt
+	mParents.clear();
+
+	return GetSahCost(costTraversal, costIntersect);
+}
+
+bool Bvh::Occluded(
+	const PrimitiveOcclude& occlude,
+	const vec3& org,
+	const vec3& dir,
+	float tmax) const
+{
+	int stack[kTraversalStackSize];
+	std::vector<int> overflow;
+	int top = 0;
+
+	vec3 invDir = { 1.f / dir.x, 1.f / dir.y, 1.f / dir.z };
+
+	if (mNodes.empty()) return false;
+
+	int curr = 0;
+
+	while (true)
+	{
+		const BvhNode& node = mNodes[curr];
+
+		if (IsIntersecting(node.bbox, org, invDir, tmax, true))
+		{
+			if (IsLeaf(node))
+			{
+				int beginId = Offset(node);
+				int endId = Offset(node) + Length(node);
+
+				for (int i = beginId; i < endId; ++i)
+					if (occlude(mPrimitives[i], org, dir, tmax))
+						return true;
+			}
+			else
+			{
+				if (top < kTraversalStackSize) stack[top++] = Right(node);
+				else overflow.push_back(Right(node));
+
+				curr = Left(node);
+				continue;
+			}
+		}
+
+		if (!overflow.empty())
+		{
+			curr = overflow.back();
+			overflow.pop_back();
+		}
+		else if (top > 0) curr = stack[--top];
+		else break;
+	}
+
+	return false;
+}
+
+void Bvh::Occluded(
+	const PrimitiveOcclude& occlude,
+	const std::vector<Ray>& rays,
+	std::vector<char>& occluded) const
+{
+	int n = static_cast<int>(rays.size());
+	occluded.resize(n);
+
+	ParallelFor(0, n, kQueryGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			// Start the segment at tmin
+			const Ray& ray = rays[i];
+			vec3 org = ray.org + ray.dir * ray.tmin;
+			occluded[i] = Occluded(occlude, org, ray.dir, ray.tmax - ray.tmin) ? 1 : 0;
+		}
+	});
+}
+
+bool Bvh::ClosestPoint(
+	const PrimitiveTriangle& triangle,
+	const vec3& p,
+	float maxDist,
+	PointHit& hit) const
+{
+	// Child to visit later with its squared box distance
+	struct Entry
+	{
+		int nodeId;
+		float d2;
+	};
+
+	Entry stack[kTraversalStackSize];
+	std::vector<Entry> overflow;
+	int top = 0;
+
+	hit = PointHit();
+	float best2 = maxDist * maxDist; // squared distance of the closest point so far
+
+	if (mNodes.empty() || !(GetDistance2(mNodes[0].bbox, p) < best2)) return false;
+
+	int curr = 0;
+
+	while (true)
+	{
+		const BvhNode& node = mNodes[curr];
+		int next = -1;
+
+		if (IsLeaf(node))
+		{
+			int beginId = Offset(node);
+			int endId = Offset(node) + Length(node);
+
+			for (int i = beginId; i < endId; ++i)
+			{
+				vec3 v0, v1, v2;
+				float u, v;
+				triangle(mPrimitives[i], v0, v1, v2);
+				vec3 q = GetClosestPoint(v0, v1, v2, p, u, v);
+
+				float d2 = dot(q - p, q - p);
+				if (d2 < best2)
+				{
+					best2 = d2;
+					hit = { mPrimitives[i].idx(), q, u, v };
+				}
+			}
+		}
+		else
+		{
+			float dl = GetDistance2(mNodes[Left(node)].bbox, p);
+			float dr = GetDistance2(mNodes[Right(node)].bbox, p);
+			bool nearL = dl < best2;
+			bool nearR = dr < best2;
+
+			if (nearL && nearR)
+			{
+				// Visit the nearer child first, keep the other for later
+				Entry far = (dl <= dr) ? Entry{ Right(node), dr } : Entry{ Left(node), dl };
+				next = (dl <= dr) ? Left(node) : Right(node);
+
+				if (top < kTraversalStackSize) stack[top++] = far;
+				else overflow.push_back(far);
+			}
+			else if (nearL) next = Left(node);
+			else if (nearR) next = Right(node);
+		}
+
+		// Pop until an entry is nearer than the closest point so far
+		while (next < 0 && (top > 0 || !overflow.empty()))
+		{
+			Entry entry;
+			if (!overflow.empty())
+			{
+				entry = overflow.back();
+				overflow.pop_back();
+			}
+			else entry = stack[--top];
+
+			if (entry.d2 < best2) next = entry.nodeId;
+		}
+
+		if (next < 0) break;
+		curr = next;
+	}
+
+	if (hit.face < 0) return false;
+
+	hit.dist = std::sqrt(best2);
+	return true;
+}
+
+void Bvh::ClosestPoint(
+	const PrimitiveTriangle& triangle,
+	const std::vector<vec3>& points,
+	float maxDist,
+	std::vector<PointHit>& hits) const
+{
+	int n = static_cast<int>(points.size());
+	hits.resize(n);
+
+	ParallelFor(0, n, kQueryGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+			ClosestPoint(triangle, points[i], maxDist, hits[i]);
+	});
+}
+
+template <class OverlapNode, class OverlapTriangle>
+void Bvh::QueryRegion(
+	const PrimitiveTriangle& triangle,
+	const OverlapNode& overlapNode,
+	const OverlapTriangle& overlapTriangle,
+	const std::function<void(const Primitive&)>& visit) const
+{
+	int stack[kTraversalStackSize];
+	std::vector<int> overflow;
+	int top = 0;
+
+	if (mNodes.empty()) return;
+
+	int curr = 0;
+
+	while (true)
+	{
+		const BvhNode& node = mNodes[curr];
+
+		if (overlapNode(node.bbox))
+		{
+			if (IsLeaf(node))
+			{
+				int beginId = Offset(node);
+				int endId = Offset(node) + Length(node);
+
+				for (int i = beginId; i < endId; ++i)
+				{
+					vec3 v0, v1, v2;
+					triangle(mPrimitives[i], v0, v1, v2);
+					if (overlapTriangle(v0, v1, v2))
+						visit(mPrimitives[i]);
+				}
+			}
+			else
+			{
+				if (top < kTraversalStackSize) stack[top++] = Right(node);
+				else overflow.push_back(Right(node));
+
+				curr = Left(node);
+				continue;
+			}
+		}
+
+		if (!overflow.empty())
+		{
+			curr = overflow.back();
+			overflow.pop_back();
+		}
+		else if (top > 0) curr = stack[--top];
+		else break;
+	}
+}
+
+// Sort faces by index and drop repeated ones
+static void SortUnique(std::vector<Primitive>& faces)
+{
+	auto less = [](const Primitive& a, const Primitive& b) { return a.idx() < b.idx(); };
+	std::sort(faces.begin(), faces.end(), less);
+	faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+}
+
+// Sort face pairs by first then second face and drop repeated ones
+static void SortUnique(std::vector<FacePair>& pairs)
+{
+	auto less = [](const FacePair& a, const FacePair& b)
+	{
+		return a.face0 < b.face0 || (a.face0 == b.face0 && a.face1 < b.face1);
+	};
+	auto equal = [](const FacePair& a, const FacePair& b)
+	{
+		return a.face0 == b.face0 && a.face1 == b.face1;
+	};
+	std::sort(pairs.begin(), pairs.end(), less);
+	pairs.erase(std::unique(pairs.begin(), pairs.end(), equal), pairs.end());
+}
+
+void Bvh::QueryAabb(
+	const PrimitiveTriangle& triangle,
+	const Aabb& box,
+	const std::function<void(const Primitive&)>& visit) const
+{
+	QueryRegion(triangle,
+		[&](const Aabb& bbox) { return IsOverlapping(bbox, box); },
+		[&](const vec3& v0, const vec3& v1, const vec3& v2) { return IsOverlapping(v0, v1, v2, box); },
+		visit);
+}
+
+void Bvh::QueryAabb(
+	const PrimitiveTriangle& triangle,
+	const Aabb& box,
+	std::vector<Primitive>& faces) const
+{
+	faces.clear();
+	QueryAabb(triangle, box, [&](const Primitive& face) { faces.push_back(face); });
+	SortUnique(faces);
+}
+
+void Bvh::QuerySphere(
+	const PrimitiveTriangle& triangle,
+	const vec3& center,
+	float radius,
+	const std::function<void(const Primitive&)>& visit) const
+{
+	float r2 = radius * radius;
+	Aabb box = Expand(Bound(center), radius);
+
+	QueryRegion(triangle,
+		[&](const Aabb& bbox) { return IsOverlapping(bbox, box) && GetDistance2(bbox, center) <= r2; },
+		[&](const vec3& v0, const vec3& v1, const vec3& v2)
+		{
+			float u, v;
+			vec3 q = GetClosestPoint(v0, v1, v2, center, u, v);
+			return dot(q - center, q - center) <= r2;
+		},
+		visit);
+}
+
+void Bvh::QuerySphere(
+	const PrimitiveTriangle& triangle,
+	const vec3& center,
+	float radius,
+	std::vector<Primitive>& faces) const
+{
+	faces.clear();
+	QuerySphere(triangle, center, radius, [&](const Primitive& face) { faces.push_back(face); });
+	SortUnique(faces);
+}
+
+Frustum GetFrustum(const vec3 (&nearCorners)[4], const vec3 (&farCorners)[4])
+{
+	vec3 center(0.f);
+	for (int i = 0; i < 4; ++i)
+		center += (nearCorners[i] + farCorners[i]) * 0.125f;
+
+	// Plane through a, b, c facing center
+	auto plane = [&](const vec3& a, const vec3& b, const vec3& c)
+	{
+		vec3 n = glm::normalize(cross(b - a, c - a));
+		if (dot(n, center - a) < 0.f) n = -n;
+		return glm::vec4(n, -dot(n, a));
+	};
+
+	Frustum frustum;
+	for (int i = 0; i < 4; ++i)
+		frustum.planes[i] = plane(nearCorners[i], nearCorners[(i + 1) % 4], farCorners[i]);
+	frustum.planes[4] = plane(nearCorners[0], nearCorners[1], nearCorners[2]);
+	frustum.planes[5] = plane(farCorners[0], farCorners[1], farCorners[2]);
+	return frustum;
+}
+
+// Box classification against a frustum
+enum FrustumSide
+{
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_PARTIAL,
+	FRUSTUM_INSIDE
+};
+
+static FrustumSide Classify(const Frustum& frustum, const Aabb& b)
+{
+	bool inside = true;
+
+	for (const glm::vec4& plane : frustum.planes)
+	{
+		// Corners farthest along and against the plane normal
+		vec3 n(plane);
+		vec3 pFar = glm::mix(b.pMin, b.pMax, glm::greaterThanEqual(n, vec3(0.f)));
+		vec3 pNear = glm::mix(b.pMax, b.pMin, glm::greaterThanEqual(n, vec3(0.f)));
+
+		if (dot(n, pFar) + plane.w < 0.f) return FRUSTUM_OUTSIDE;
+		if (dot(n, pNear) + plane.w < 0.f) inside = false;
+	}
+
+	return inside ? FRUSTUM_INSIDE : FRUSTUM_PARTIAL;
+}
+
+static bool IsOverlapping(const Frustum& frustum, const vec3& v0, const vec3& v1, const vec3& v2)
+{
+	for (const glm::vec4& plane : frustum.planes)
+	{
+		vec3 n(plane);
+		if (dot(n, v0) + plane.w < 0.f && dot(n, v1) + plane.w < 0.f && dot(n, v2) + plane.w < 0.f)
+			return false;
+	}
+
+	return true;
+}
+
+void Bvh::QueryFrustum(
+	const PrimitiveTriangle& triangle,
+	const Frustum& frustum,
+	const std::function<void(const Primitive&)>& visit) const
+{
+	// Node to visit later, inside if its box is known to lie in the frustum
+	struct Entry
+	{
+		int nodeId;
+		bool inside;
+	};
+
+	Entry stack[kTraversalStackSize];
+	std::vector<Entry> overflow;
+	int top = 0;
+
+	if (mNodes.empty()) return;
+
+	Entry curr = { 0, false };
+
+	while (true)
+	{
+		const BvhNode& node = mNodes[curr.nodeId];
+		FrustumSide side = curr.inside ? FRUSTUM_INSIDE : Classify(frustum, node.bbox);
+
+		if (side != FRUSTUM_OUTSIDE)
+		{
+			bool inside = side == FRUSTUM_INSIDE;
+
+			if (IsLeaf(node))
+			{
+				int beginId = Offset(node);
+				int endId = Offset(node) + Length(node);
+
+				for (int i = beginId; i < endId; ++i)
+				{
+					vec3 v0, v1, v2;
+					if (!inside)
+					{
+						triangle(mPrimitives[i], v0, v1, v2);
+						if (!IsOverlapping(frustum, v0, v1, v2)) continue;
+					}
+					visit(mPrimitives[i]);
+				}
+			}
+			else
+			{
+				Entry right = { Right(node), inside };
+				if (top < kTraversalStackSize) stack[top++] = right;
+				else overflow.push_back(right);
+
+				curr = { Left(node), inside };
+				continue;
+			}
+		}
+
+		if (!overflow.empty())
+		{
+			curr = overflow.back();
+			overflow.pop_back();
+		}
+		else if (top > 0) curr = stack[--top];
+		else break;
+	}
+}
+
+void Bvh::QueryFrustum(
+	const PrimitiveTriangle& triangle,
+	const Frustum& frustum,
+	std::vector<Primitive>& faces) const
+{
+	faces.clear();
+	QueryFrustum(triangle, frustum, [&](const Primitive& face) { faces.push_back(face); });
+	SortUnique(faces);
+}
+
+// Whether the node pair (a, b) is split at a rather than at b: b is a
+// leaf, or a is inner with the larger box, bboxB being the box of b in the
+// space of a
+static bool IsSplitFirst(const BvhNode& a, const BvhNode& b, const Aabb& bboxB)
+{
+	if (IsLeaf(a)) return false;
+	return IsLeaf(b) || GetArea(a.bbox) >= GetArea(bboxB);
+}
+
+bool Bvh::CollideSubtrees(
+	int nodeId,
+	int otherId,
+	const PrimitiveTriangle& triangle,
+	const Bvh& other,
+	const PrimitiveTriangle& otherTriangle,
+	const glm::mat4& transform,
+	const std::function<bool(const FacePair&)>& visit) const
+{
+	struct Entry
+	{
+		int nodeId;
+		int otherId;
+	};
+
+	Entry stack[kTraversalStackSize];
+	std::vector<Entry> overflow;
+	int top = 0;
+
+	Entry curr = { nodeId, otherId };
+
+	while (true)
+	{
+		const BvhNode& a = mNodes[curr.nodeId];
+		const BvhNode& b = other.mNodes[curr.otherId];
+		Aabb bboxB = Transform(b.bbox, transform);
+
+		if (IsOverlapping(a.bbox, bboxB))
+		{
+			if (IsLeaf(a) && IsLeaf(b))
+			{
+				for (int j = Offset(b); j < Offset(b) + Length(b); ++j)
+				{
+					vec3 w0, w1, w2;
+					otherTriangle(other.mPrimitives[j], w0, w1, w2);
+					w0 = vec3(transform * glm::vec4(w0, 1.f));
+					w1 = vec3(transform * glm::vec4(w1, 1.f));
+					w2 = vec3(transform * glm::vec4(w2, 1.f));
+
+					Aabb wbox = Bound(w0, w1, w2);
+					if (!IsOverlapping(a.bbox, wbox)) continue;
+
+					for (int i = Offset(a); i < Offset(a) + Length(a); ++i)
+					{
+						vec3 v0, v1, v2;
+						triangle(mPrimitives[i], v0, v1, v2);
+						if (!IsOverlapping(Bound(v0, v1, v2), wbox)) continue;
+
+						if (IsIntersecting(v0, v1, v2, w0, w1, w2) &&
+							!visit({ mPrimitives[i].idx(), other.mPrimitives[j].idx() }))
+							return false;
+					}
+				}
+			}
+			else
+			{
+				Entry first, second;
+				if (IsSplitFirst(a, b, bboxB))
+				{
+					first = { Left(a), curr.otherId };
+					second = { Right(a), curr.otherId };
+				}
+				else
+				{
+					first = { curr.nodeId, Left(b) };
+					second = { curr.nodeId, Right(b) };
+				}
+
+				if (top < kTraversalStackSize) stack[top++] = second;
+				else overflow.push_back(second);
+
+				curr = first;
+				continue;
+			}
+		}
+
+		if (!overflow.empty())
+		{
+			curr = overflow.back();
+			overflow.pop_back();
+		}
+		else if (top > 0) curr = stack[--top];
+		else break;
+	}
+
+	return true;
+}
+
+bool Bvh::Collides(
+	const PrimitiveTriangle& triangle,
+	const Bvh& other,
+	const PrimitiveTriangle& otherTriangle,
+	const glm::mat4& transform) const
+{
+	if (mNodes.empty() || other.mNodes.empty()) return false;
+
+	return !CollideSubtrees(0, 0, triangle, other, otherTriangle, transform,
+		[](const FacePair&) { return false; });
+}
+
+void Bvh::CollidePairs(
+	const PrimitiveTriangle& triangle,
+	const Bvh& other,
+	const PrimitiveTriangle& otherTriangle,
+	const glm::mat4& transform,
+	std::vector<FacePair>& pairs) const
+{
+	pairs.clear();
+	if (mNodes.empty() || other.mNodes.empty()) return;
+
+	// Split overlapping node pairs breadth first, the way the traversal
+	// would, until there are enough of them to balance the threads
+	using NodePair = std::pair<int, int>;
+	std::vector<NodePair> frontier = { { 0, 0 } }, next;
+	size_t numTasks = 64 * static_cast<size_t>(TaskPool::Instance().GetNumThreads());
+
+	while (frontier.size() < numTasks)
+	{
+		bool split = false;
+		next.clear();
+
+		for (const NodePair& pair : frontier)
+		{
+			const BvhNode& a = mNodes[pair.first];
+			const BvhNode& b = other.mNodes[pair.second];
+			Aabb bboxB = Transform(b.bbox, transform);
+
+			if (!IsOverlapping(a.bbox, bboxB)) continue;
+
+			if (IsLeaf(a) && IsLeaf(b))
+				next.push_back(pair);
+			else if (IsSplitFirst(a, b, bboxB))
+			{
+				next.push_back({ Left(a), pair.second });
+				next.push_back({ Right(a), pair.second });
+				split = true;
+			}
+			else
+			{
+				next.push_back({ pair.first, Left(b) });
+				next.push_back({ pair.first, Right(b) });
+				split = true;
+			}
+		}
+
+		frontier.swap(next);
+		if (!split) break;
+	}
+
+	int n = static_cast<int>(frontier.size());
+	std::vector<std::vector<FacePair>> found(n);
+
+	ParallelFor(0, n, 1, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			std::vector<FacePair>& out = found[i];
+			CollideSubtrees(frontier[i].first, frontier[i].second, triangle, other, otherTriangle, transform,
+				[&](const FacePair& pair) { out.push_back(pair); return true; });
+		}
+	});
+
+	for (const std::vector<FacePair>& out : found)
+		pairs.insert(pairs.end(), out.begin(), out.end());
+
+	// A face pair is found once per pair of leaves referencing both faces
+	SortUnique(pairs);
+}
+
+// Whether faces f and g of triangles share a corner vertex
+static bool IsAdjacent(const TriangleBuffer& triangles, int f, int g)
+{
+	const int* a = &triangles.GetIndices()[3 * f];
+	const int* b = &triangles.GetIndices()[3 * g];
+	for (int i = 0; i < 3; ++i)
+		if (a[i] == b[0] || a[i] == b[1] || a[i] == b[2])
+			return true;
+	return false;
+}
+
+// Append the pair of faces f and g in index order if their triangles
+// intersect and do not share a vertex. The lower face is passed first, so
+// rounding of the triangle test does not depend on the tree.
+static void CollideFaces(const PrimitiveTriangle& triangle, int f, int g, std::vector<FacePair>& pairs)
+{
+	if (IsAdjacent(triangle.triangles, f, g)) return;
+	if (f > g) std::swap(f, g);
+
+	vec3 v0, v1, v2, w0, w1, w2;
+	triangle.triangles.GetTriangle(f, v0, v1, v2);
+	triangle.triangles.GetTriangle(g, w0, w1, w2);
+	if (!IsOverlapping(Bound(v0, v1, v2), Bound(w0, w1, w2))) return;
+
+	if (IsIntersecting(v0, v1, v2, w0, w1, w2))
+		pairs.push_back({ f, g });
+}
+
+void Bvh::SelfCollideSubtrees(
+	int nodeId,
+	int otherId,
+	const PrimitiveTriangle& triangle,
+	std::vector<FacePair>& pairs) const
+{
+	struct Entry
+	{
+		int nodeId;
+		int otherId;
+	};
+
+	Entry stack[kTraversalStackSize];
+	std::vector<Entry> overflow;
+	int top = 0;
+
+	auto push = [&](const Entry& entry)
+	{
+		if (top < kTraversalStackSize) stack[top++] = entry;
+		else overflow.push_back(entry);
+	};
+
+	Entry curr = { nodeId, otherId };
+
+	while (true)
+	{
+		const BvhNode& a = mNodes[curr.nodeId];
+		const BvhNode& b = mNodes[curr.otherId];
+
+		if (curr.nodeId == curr.otherId)
+		{
+			// A subtree against itself: both children against themselves
+			// and against each other
+			if (IsLeaf(a))
+			{
+				for (int i = Offset(a); i < Offset(a) + Length(a); ++i)
+					for (int j = i + 1; j < Offset(a) + Length(a); ++j)
+						CollideFaces(triangle, mPrimitives[i].idx(), mPrimitives[j].idx(), pairs);
+			}
+			else
+			{
+				push({ Left(a), Right(a) });
+				push({ Right(a), Right(a) });
+				curr = { Left(a), Left(a) };
+				continue;
+			}
+		}
+		else if (IsOverlapping(a.bbox, b.bbox))
+		{
+			if (IsLeaf(a) && IsLeaf(b))
+			{
+				for (int i = Offset(a); i < Offset(a) + Length(a); ++i)
+					for (int j = Offset(b); j < Offset(b) + Length(b); ++j)
+						CollideFaces(triangle, mPrimitives[i].idx(), mPrimitives[j].idx(), pairs);
+			}
+			else
+			{
+				if (IsSplitFirst(a, b, b.bbox))
+				{
+					push({ Right(a), curr.otherId });
+					curr = { Left(a), curr.otherId };
+				}
+				else
+				{
+					push({ curr.nodeId, Right(b) });
+					curr = { curr.nodeId, Left(b) };
+				}
+				continue;
+			}
+		}
+
+		if (!overflow.empty())
+		{
+			curr = overflow.back();
+			overflow.pop_back();
+		}
+		else if (top > 0) curr = stack[--top];
+		else break;
+	}
+}
+
+void Bvh::SelfCollidePairs(
+	const PrimitiveTriangle& triangle,
+	std::vector<FacePair>& pairs) const
+{
+	pairs.clear();
+	if (mNodes.empty()) return;
+
+	// Split node pairs breadth first as in CollidePairs(...), a node
+	// against itself into three pairs
+	using NodePair = std::pair<int, int>;
+	std::vector<NodePair> frontier = { { 0, 0 } }, next;
+	size_t numTasks = 64 * static_cast<size_t>(TaskPool::Instance().GetNumThreads());
+
+	while (frontier.size() < numTasks)
+	{
+		bool split = false;
+		next.clear();
+
+		for (const NodePair& pair : frontier)
+		{
+			const BvhNode& a = mNodes[pair.first];
+			const BvhNode& b = mNodes[pair.second];
+
+			if (pair.first == pair.second)
+			{
+				if (IsLeaf(a))
+					next.push_back(pair);
+				else
+				{
+					next.push_back({ Left(a), Left(a) });
+					next.push_back({ Left(a), Right(a) });
+					next.push_back({ Right(a), Right(a) });
+					split = true;
+				}
+			}
+			else if (!IsOverlapping(a.bbox, b.bbox))
+				continue;
+			else if (IsLeaf(a) && IsLeaf(b))
+				next.push_back(pair);
+			else if (IsSplitFirst(a, b, b.bbox))
+			{
+				next.push_back({ Left(a), pair.second });
+				next.push_back({ Right(a), pair.second });
+				split = true;
+			}
+			else
+			{
+				next.push_back({ pair.first, Left(b) });
+				next.push_back({ pair.first, Right(b) });
+				split = true;
+			}
+		}
+
+		frontier.swap(next);
+		if (!split) break;
+	}
+
+	int n = static_cast<int>(frontier.size());
+	std::vector<std::vector<FacePair>> found(n);
+
+	ParallelFor(0, n, 1, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+			SelfCollideSubtrees(frontier[i].first, frontier[i].second, triangle, found[i]);
+	});
+
+	for (const std::vector<FacePair>& out : found)
+		pairs.insert(pairs.end(), out.begin(), out.end());
+
+	SortUnique(pairs);
+}
+
+// Working buffers of KNearest, grown by the first queries of a thread and
+// reused by the later ones
+struct KNearestScratch
+{
+	struct Entry
+	{
+		int nodeId;
+		float d2;
+	};
+
+	std::vector<PointHit> heap; // k best so far, farthest on top; dist is squared
+	std::vector<Entry> stack;   // children to visit later with squared box distance
+};
+
+static thread_local KNearestScratch tKNearestScratch;
+
+int Bvh::KNearest(
+	const PrimitiveTriangle& triangle,
+	const vec3& p,
+	int k,
+	PointHit* hits) const
+{
+	using Entry = KNearestScratch::Entry;
+
+	std::vector<PointHit>& heap = tKNearestScratch.heap;
+	std::vector<Entry>& stack = tKNearestScratch.stack;
+	heap.clear();
+	stack.clear();
+
+	if (mNodes.empty() || k <= 0) return 0;
+
+	auto farther = [](const PointHit& a, const PointHit& b) { return a.dist < b.dist; };
+
+	// Squared distance a face or node must beat to enter the k best
+	auto bound2 = [&]() { return static_cast<int>(heap.size()) < k ? FLT_MAX : heap.front().dist; };
+
+	int curr = 0;
+
+	while (true)
+	{
+		const BvhNode& node = mNodes[curr];
+		int next = -1;
+
+		if (IsLeaf(node))
+		{
+			int beginId = Offset(node);
+			int endId = Offset(node) + Length(node);
+
+			for (int i = beginId; i < endId; ++i)
+			{
+				vec3 v0, v1, v2;
+				float u, v;
+				triangle(mPrimitives[i], v0, v1, v2);
+				vec3 q = GetClosestPoint(v0, v1, v2, p, u, v);
+
+				float d2 = dot(q - p, q - p);
+				if (!(d2 < bound2())) continue;
+
+				// Spatial splits reference a face from several leaves
+				int face = mPrimitives[i].idx();
+				if (std::any_of(heap.begin(), heap.end(), [&](const PointHit& h) { return h.face == face; }))
+					continue;
+
+				if (static_cast<int>(heap.size()) == k)
+				{
+					std::pop_heap(heap.begin(), heap.end(), farther);
+					heap.pop_back();
+				}
+				heap.push_back({ face, q, u, v, d2 });
+				std::push_heap(heap.begin(), heap.end(), farther);
+			}
+		}
+		else
+		{
+			float dl = GetDistance2(mNodes[Left(node)].bbox, p);
+			float dr = GetDistance2(mNodes[Right(node)].bbox, p);
+			float best2 = bound2();
+			bool nearL = dl < best2;
+			bool nearR = dr < best2;
+
+			if (nearL && nearR)
+			{
+				// Visit the nearer child first, keep the other for later
+				stack.push_back((dl <= dr) ? Entry{ Right(node), dr } : Entry{ Left(node), dl });
+				next = (dl <= dr) ? Left(node) : Right(node);
+			}
+			else if (nearL) next = Left(node);
+			else if (nearR) next = Right(node);
+		}
+
+		// Pop until an entry is nearer than the k-th best so far
+		while (next < 0 && !stack.empty())
+		{
+			Entry entry = stack.back();
+			stack.pop_back();
+
+			if (entry.d2 < bound2()) next = entry.nodeId;
+		}
+
+		if (next < 0) break;
+		curr = next;
+	}
+
+	std::sort_heap(heap.begin(), heap.end(), farther);
+
+	int count = static_cast<int>(heap.size());
+	for (int i = 0; i < count; ++i)
+	{
+		hits[i] = heap[i];
+		hits[i].dist = std::sqrt(heap[i].dist);
+	}
+
+	return count;
+}
+
+void Bvh::KNearest(
+	const PrimitiveTriangle& triangle,
+	const vec3& p,
+	int k,
+	std::vector<PointHit>& hits) const
+{
+	hits.resize(std::max(k, 0));
+	hits.resize(KNearest(triangle, p, k, hits.data()));
+}
+
+void Bvh::KNearest(
+	const PrimitiveTriangle& triangle,
+	const std::vector<vec3>& points,
+	int k,
+	std::vector<PointHit>& hits) const
+{
+	int n = static_cast<int>(points.size());
+	k = std::max(k, 0);
+	hits.resize(static_cast<size_t>(n) * k);
+
+	ParallelFor(0, n, kQueryGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			PointHit* nearest = hits.data() + static_cast<size_t>(i) * k;
+			int count = KNearest(triangle, points[i], k, nearest);
+			std::fill(nearest + count, nearest + k, PointHit());
+		}
+	});
+}
+
+void Bvh::Intersect(
+	const PrimitiveTriangle& triangle,
+	const std::vector<Ray>& rays,
+	std::vector<RayHit>& hits,
+	int packetSize) const
+{
+	int n = static_cast<int>(rays.size());
+	hits.resize(n);
+
+	ParallelFor(0, n, kQueryGrain, [&](int b, int e)
+	{
+		// kQueryGrain is a multiple of every packet size
+		if (packetSize == 4 || packetSize == 8 || packetSize == 16)
+		{
+			for (int i = b; i < e; i += packetSize)
+			{
+				int numRays = std::min(packetSize, e - i);
+				switch (packetSize)
+				{
+				case 4: IntersectPacket<4>(triangle, &rays[i], &hits[i], numRays); break;
+				case 8: IntersectPacket<8>(triangle, &rays[i], &hits[i], numRays); break;
+				case 16: IntersectPacket<16>(triangle, &rays[i], &hits[i], numRays); break;
+				}
+			}
+			return;
+		}
+
+		BvhTraceNone trace;
+
+		for (int i = b; i < e; ++i)
+		{
+			const Ray& ray = rays[i];
+			PrimitiveHit context(triangle, ray.tmin);
+			float dist = ray.tmax;
+
+			Intersect(context, ray.org, ray.dir, dist, trace);
+			hits[i] = context.hit;
+		}
+	});
+}
+
+void Bvh::IntersectStream(
+	const PrimitiveTriangle& triangle,
+	const std::vector<Ray>& rays,
+	std::vector<RayHit>& hits,
+	int packetSize) const
+{
+	int n = static_cast<int>(rays.size());
+
+	if (mNodes.empty())
+	{
+		hits.assign(n, RayHit());
+		return;
+	}
+
+	const Aabb& root = mNodes[0].bbox;
+	std::vector<uint64_t> keys(n);
+	std::vector<int> order(n);
+
+	// 3 bits octant, 30 bits origin, 30 bits direction
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			const Ray& ray = rays[i];
+			uint64_t octant = (ray.dir.x < 0) | (ray.dir.y < 0) << 1 | (ray.dir.z < 0) << 2;
+			uint64_t org = EncodeMorton(GetOffset(root, ray.org), 30);
+			// a zero direction would normalize to NaN, its direction bits are 0
+			float length = glm::length(ray.dir);
+			uint64_t dir = length > 0.f ? EncodeMorton(ray.dir / length * 0.5f + 0.5f, 30) : 0;
+
+			keys[i] = octant << 60 | org << 30 | dir;
+			order[i] = i;
+		}
+	});
+
+	ParallelRadixSort(keys, order, 63);
+
+	std::vector<Ray> sorted(n);
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+			sorted[i] = rays[order[i]];
+	});
+
+	std::vector<RayHit> sortedHits;
+	Intersect(triangle, sorted, sortedHits, packetSize);
+
+	hits.resize(n);
+	ParallelFor(0, n, kLinearGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+			hits[order[i]] = sortedHits[i];
+	});
 }
@@ -2,14 +2,19 @@
 #ifndef BOUNDING_VOLUME_HIERARCHY_H
 #define BOUNDING_VOLUME_HIERARCHY_H
 
+#include <atomic>
+#include <functional>
 #include <memory>
 
 #include "aabb.h"
 #include "Mesh.h"
+#include "tribuffer.h"
 
 struct BvhNode;
 struct PrimitiveBound;
+struct PrimitiveRef;
 struct PrimitiveSplit;
+struct SpatialBuild;
 
 using Primitive = OpenMesh::FaceHandle;
 
@@ -26,39 +31,78 @@ struct BvhNode
 
 struct PrimitiveBound
 {
-	typedef OpenMesh::VertexHandle   VertexHandle;
-	typedef OpenMesh::HalfedgeHandle HalfedgeHandle;
-	typedef OpenMesh::EdgeHandle     EdgeHandle;
-	typedef OpenMesh::FaceHandle     FaceHandle;
+	Aabb operator() (const Primitive& primitive) const
+	{
+		vec3 v0, v1, v2;
+		triangles.GetTriangle(primitive.idx(), v0, v1, v2);
+		return Bound(v0, v1, v2);
+	}
 
-	Aabb operator() (const Primitive& hF) const;
+	PrimitiveBound(const TriangleBuffer& triangles) : triangles(triangles) {}
 
-	PrimitiveBound(const TheMesh& mesh) : mesh(mesh) {}
+	const TriangleBuffer& triangles;
+};
 
-	const TheMesh& mesh;
+// Bounds of a primitive cached once before building, so that splitting
+// never goes back to the mesh
+struct PrimitiveRef
+{
+	Aabb bbox;
+	vec3 centroid;
+	int id; // index into the primitive array given to the builder
+};
+
+// Best binned SAH partition of a range of references
+struct SahSplit
+{
+	int dim = -1;          // split axis, -1 if no valid partition exists
+	int bin = -1;          // last bin on the left side
+	float cost = FLT_MAX;  // A(L) * N(L) + A(R) * N(R)
+	Aabb bbox = Bound();   // bounds of all references
+	Aabb cbox = Bound();   // bounds of all centroids
+	Aabb lbox = Bound();   // bounds of left side
+	Aabb rbox = Bound();   // bounds of right side
 };
 
 struct PrimitiveSplit
 {
-	int operator() (std::vector<Primitive>& primitives, int beginId, int endId) const;
+	enum Method
+	{
+		SPLIT_MIDDLE,       // partition through the midpoint of node's extent
+		SPLIT_EQUAL_COUNTS, // partition into equally-sized subsets
+		SPLIT_SAH           // binned surface area heuristic
+	};
+
+	int operator() (std::vector<PrimitiveRef>& refs, int beginId, int endId) const;
+
+	SahSplit FindSah(const std::vector<PrimitiveRef>& refs, int beginId, int endId) const;
+
+	PrimitiveSplit(int method = SPLIT_EQUAL_COUNTS) : method(method) {}
 
-	PrimitiveSplit(const PrimitiveBound& bound) : bound(bound) {}
+	int method = SPLIT_EQUAL_COUNTS;
 
-	const PrimitiveBound& bound;
+	// SAH parameters
+	int numBins = 12;          // number of buckets along each axis
+	int maxLeafSize = 4;       // largest leaf SAH may choose over splitting
+	float costTraversal = 1.f; // relative cost of visiting an inner node
+	float costIntersect = 1.f; // relative cost of testing a primitive
+
+protected:
+	int SplitMiddle(std::vector<PrimitiveRef>& refs, int beginId, int endId) const;
+	int SplitEqualCounts(std::vector<PrimitiveRef>& refs, int beginId, int endId) const;
+	int SplitSah(std::vector<PrimitiveRef>& refs, int beginId, int endId) const;
 };
 
 struct PrimitiveTriangle
 {
-	typedef OpenMesh::VertexHandle   VertexHandle;
-	typedef OpenMesh::HalfedgeHandle HalfedgeHandle;
-	typedef OpenMesh::EdgeHandle     EdgeHandle;
-	typedef OpenMesh::FaceHandle     FaceHandle;
-
-	void operator()(const Primitive& p, vec3& v0, vec3& v1, vec3& v2) const;
+	void operator()(const Primitive& primitive, vec3& v0, vec3& v1, vec3& v2) const
+	{
+		triangles.GetTriangle(primitive.idx(), v0, v1, v2);
+	}
 
-	PrimitiveTriangle(const TheMesh& mesh) : mesh(mesh) {}
+	PrimitiveTriangle(const TriangleBuffer& triangles) : triangles(triangles) {}
 
-	const TheMesh& mesh;
+	const TriangleBuffer& triangles;
 };
 
 struct PrimitiveCollide
@@ -72,20 +116,330 @@ struct PrimitiveCollide
 	bool culling = 1;  // 0 for ray tracing; 1 for picking triangle
 };
 
+// Any-hit test of a primitive: whether it blocks the ray within (0, tmax).
+// Keeps no state, so one instance can be shared by all threads.
+struct PrimitiveOcclude
+{
+	bool operator() (const Primitive& primitive, const vec3& org, const vec3& dir, float tmax) const;
+
+	PrimitiveOcclude(const PrimitiveTriangle& tri) : triangle(tri) {}
+
+	const PrimitiveTriangle& triangle;
+	bool culling = 0;  // 0 for shadow rays blocked by both sides
+};
+
+// Ray of the batch queries, hits are accepted within (tmin, tmax)
+struct Ray
+{
+	vec3 org;
+	vec3 dir;
+	float tmin = 0.f;
+	float tmax = FLT_MAX;
+};
+
+// Closest hit of a ray: face index (-1 for a miss), distance and
+// barycentrics of the hit point w.r.t. the face's second and third vertex
+struct RayHit
+{
+	int face = -1;
+	float t = FLT_MAX;
+	float u = 0.f;
+	float v = 0.f;
+};
+
+// Closest point of a query on the triangles: face index (-1 if none within
+// the search distance), the point, its barycentrics w.r.t. the face's
+// second and third vertex and its distance to the query
+struct PointHit
+{
+	int face = -1;
+	vec3 point = vec3(0.f);
+	float u = 0.f;
+	float v = 0.f;
+	float dist = FLT_MAX;
+};
+
+// Convex volume bounded by planes (n, d), inside where dot(n, p) + d >= 0,
+// e.g. the view volume of a screen rectangle
+struct Frustum
+{
+	glm::vec4 planes[6];
+};
+
+// Frustum of a truncated pyramid from its near and far corners, both
+// listed in the same order around the faces
+Frustum GetFrustum(const vec3 (&nearCorners)[4], const vec3 (&farCorners)[4]);
+
+// Intersecting faces of two meshes, face0 of the first and face1 of the
+// second
+struct FacePair
+{
+	int face0;
+	int face1;
+};
+
+// Closest-hit callback of the batch queries. Unlike PrimitiveCollide it is
+// a per-thread query context: each thread fills its own hit record.
+struct PrimitiveHit
+{
+	bool operator() (const Primitive& primitive, const vec3& org, const vec3& dir, float& dist) const;
+
+	PrimitiveHit(const PrimitiveTriangle& tri, float tmin) : triangle(tri), tmin(tmin) {}
+
+	const PrimitiveTriangle& triangle;
+	float tmin;
+	bool culling = 0;
+	mutable RayHit hit;
+};
+
+// Instrumentation policies of Bvh::Intersect, selected at compile time.
+// Traversal reports every visited node whose box is hit and every tested
+// primitive; the empty calls of BvhTraceNone compile away.
+struct BvhTraceNone
+{
+	void VisitNode(const BvhNode&) {}
+	void TestPrimitive() {}
+};
+
+// Count hit nodes and tested primitives
+struct BvhTraceCount
+{
+	void VisitNode(const BvhNode&) { ++numNodes; }
+	void TestPrimitive() { ++numPrimitives; }
+
+	int numNodes = 0;
+	int numPrimitives = 0;
+};
+
+// Count and record the boxes of hit nodes in traversal order, for display
+struct BvhTraceRecord : BvhTraceCount
+{
+	BvhTraceRecord(std::vector<Aabb>& boxes) : bboxes(boxes) {}
+
+	void VisitNode(const BvhNode& node);
+
+	std::vector<Aabb>& bboxes;
+};
+
 class Bvh
 {
 public:
-	void Build(
+	// Returns SAH cost of the built tree under split's cost constants
+	float Build(
 		const std::vector<Primitive>& primitives,
 		const PrimitiveBound& bound,
 		const PrimitiveSplit& split,
 		int numObjPerNode = 1);
 
+	// Linear Bvh: sort primitives along the Morton curve (30 or 63 bits) of
+	// their centroids and emit the hierarchy in parallel with one primitive
+	// per leaf. Returns SAH cost of the built tree.
+	float BuildLinear(
+		const std::vector<Primitive>& primitives,
+		const PrimitiveBound& bound,
+		int mortonBits = 30);
+
+	// Bottom-up Bvh by parallel locally-ordered clustering (Meister and
+	// Bittner 2018): clusters start as single primitives in Morton order
+	// and each one merges with its nearest neighbor among the next and
+	// previous radius clusters when they pick each other.
+	// Returns SAH cost of the built tree.
+	float BuildPloc(
+		const std::vector<Primitive>& primitives,
+		const PrimitiveBound& bound,
+		int radius = 16,
+		int mortonBits = 30);
+
+	// Spatial split Bvh (SBVH): SAH build that may also split references of
+	// large primitives at bin planes, clipping their bounds to each side.
+	// References are kept under (1 + maxDuplication) * n, so leaves may
+	// list a primitive more than once. Returns SAH cost of the built tree.
+	float BuildSpatial(
+		const std::vector<Primitive>& primitives,
+		const PrimitiveBound& bound,
+		const PrimitiveTriangle& triangle,
+		const PrimitiveSplit& split,
+		float maxDuplication = 0.3f,
+		int numObjPerNode = 1);
+
+	// Improve a built tree in place by tree rotations (Kensler 2008): each
+	// pass visits nodes bottom-up and swaps a child with a grandchild under
+	// the other child whenever that shrinks the area of the inner node in
+	// between. Stops after maxPasses, when a pass finds nothing to rotate,
+	// or when timeBudgetMs (if positive) runs out. Returns the new SAH cost.
+	float Optimize(
+		int maxPasses = 16,
+		float timeBudgetMs = 0.f,
+		float costTraversal = 1.f,
+		float costIntersect = 1.f);
+
+	// Recompute node boxes bottom-up after primitives moved, keeping the
+	// topology. Levels are processed deepest first, nodes of one level in
+	// parallel.
+	void Refit(const PrimitiveBound& bound);
+
+	// Refit only the leaves holding the given primitives and their ancestors
+	void Refit(const PrimitiveBound& bound, const std::vector<Primitive>& moved);
+
+	// Closest hit, returns whether dist was shortened
 	bool Intersect(
 		const PrimitiveCollide& collide,
 		const vec3& org,
 		const vec3& dir,
-		float& dist) const;
+		float& dist) const
+	{
+		BvhTraceNone trace;
+		return Intersect(collide, org, dir, dist, trace);
+	}
+
+	// Closest hit with any callback of the PrimitiveCollide contract and
+	// instrumentation policy
+	template <class Collide, class Trace>
+	bool Intersect(
+		const Collide& collide,
+		const vec3& org,
+		const vec3& dir,
+		float& dist,
+		Trace& trace) const;
+
+	// Closest hits of many rays in parallel. The tree is only read, every
+	// task uses its own PrimitiveHit context. packetSize 4, 8 or 16 traces
+	// consecutive rays as SIMD packets, any other value one ray at a time.
+	void Intersect(
+		const PrimitiveTriangle& triangle,
+		const std::vector<Ray>& rays,
+		std::vector<RayHit>& hits,
+		int packetSize = 1) const;
+
+	// Batch query for incoherent rays: sort the rays by direction octant,
+	// then by Morton keys of origin (within the root box) and direction,
+	// trace them in that order and scatter the hits back to rays' order
+	void IntersectStream(
+		const PrimitiveTriangle& triangle,
+		const std::vector<Ray>& rays,
+		std::vector<RayHit>& hits,
+		int packetSize = 1) const;
+
+	// Any hit within (0, tmax): stops at the first blocking primitive and
+	// visits children in no particular order
+	bool Occluded(
+		const PrimitiveOcclude& occlude,
+		const vec3& org,
+		const vec3& dir,
+		float tmax) const;
+
+	// Occluded for many rays in parallel, occluded[i] is 1 if ray i is
+	// blocked within (tmin, tmax)
+	void Occluded(
+		const PrimitiveOcclude& occlude,
+		const std::vector<Ray>& rays,
+		std::vector<char>& occluded) const;
+
+	// Closest point on the triangles to p nearer than maxDist. Prunes nodes
+	// farther than the closest point so far and visits the nearer child
+	// first. Returns false if no triangle is nearer than maxDist.
+	bool ClosestPoint(
+		const PrimitiveTriangle& triangle,
+		const vec3& p,
+		float maxDist,
+		PointHit& hit) const;
+
+	// ClosestPoint for many points in parallel
+	void ClosestPoint(
+		const PrimitiveTriangle& triangle,
+		const std::vector<vec3>& points,
+		float maxDist,
+		std::vector<PointHit>& hits) const;
+
+	// k nearest faces to p by closest point, nearest first; fewer if the
+	// tree holds fewer faces. Prunes nodes not nearer than the k-th best
+	// so far. Working buffers are kept per thread, so repeated queries into
+	// the same hits allocate nothing.
+	void KNearest(
+		const PrimitiveTriangle& triangle,
+		const vec3& p,
+		int k,
+		std::vector<PointHit>& hits) const;
+
+	// KNearest for many points in parallel: hits[i * k + j] is the j-th
+	// nearest face to points[i], face = -1 past the faces found
+	void KNearest(
+		const PrimitiveTriangle& triangle,
+		const std::vector<vec3>& points,
+		int k,
+		std::vector<PointHit>& hits) const;
+
+	// Visit every face whose triangle overlaps box, exact test at the
+	// leaves. A face referenced by several leaves of a spatial-split tree
+	// is visited once per leaf.
+	void QueryAabb(
+		const PrimitiveTriangle& triangle,
+		const Aabb& box,
+		const std::function<void(const Primitive&)>& visit) const;
+
+	// Faces overlapping box into faces, each once in index order
+	void QueryAabb(
+		const PrimitiveTriangle& triangle,
+		const Aabb& box,
+		std::vector<Primitive>& faces) const;
+
+	// Visit every face whose triangle is within radius of center, exact
+	// test at the leaves, same repetition as QueryAabb(...)
+	void QuerySphere(
+		const PrimitiveTriangle& triangle,
+		const vec3& center,
+		float radius,
+		const std::function<void(const Primitive&)>& visit) const;
+
+	// Faces within radius of center into faces, each once in index order
+	void QuerySphere(
+		const PrimitiveTriangle& triangle,
+		const vec3& center,
+		float radius,
+		std::vector<Primitive>& faces) const;
+
+	// Visit every face whose triangle overlaps frustum. Subtrees whose box
+	// lies inside the frustum are visited whole without testing their
+	// triangles. A triangle is rejected when its vertices are all outside
+	// one plane, so triangles near the frustum edges may be accepted
+	// without overlapping it. Same repetition as QueryAabb(...).
+	void QueryFrustum(
+		const PrimitiveTriangle& triangle,
+		const Frustum& frustum,
+		const std::function<void(const Primitive&)>& visit) const;
+
+	// Faces overlapping frustum into faces, each once in index order
+	void QueryFrustum(
+		const PrimitiveTriangle& triangle,
+		const Frustum& frustum,
+		std::vector<Primitive>& faces) const;
+
+	// Whether a face of this mesh intersects a face of the mesh of other
+	// moved by transform, from the space of other to the space of this
+	// one. Stops at the first intersecting pair.
+	bool Collides(
+		const PrimitiveTriangle& triangle,
+		const Bvh& other,
+		const PrimitiveTriangle& otherTriangle,
+		const glm::mat4& transform) const;
+
+	// All pairs of intersecting faces into pairs, each once, sorted by
+	// face0 then face1. The top levels of both trees are split into node
+	// pairs traversed in parallel.
+	void CollidePairs(
+		const PrimitiveTriangle& triangle,
+		const Bvh& other,
+		const PrimitiveTriangle& otherTriangle,
+		const glm::mat4& transform,
+		std::vector<FacePair>& pairs) const;
+
+	// Pairs of intersecting faces of the mesh itself into pairs, each once
+	// with face0 < face1, sorted. Faces sharing a vertex, hence also those
+	// sharing an edge, are never tested against each other. Parallel as
+	// CollidePairs(...).
+	void SelfCollidePairs(
+		const PrimitiveTriangle& triangle,
+		std::vector<FacePair>& pairs) const;
 
 	std::vector<BvhNode>& GetNodes() { return mNodes; }
 	const std::vector<BvhNode>& GetNodes() const { return mNodes; }
@@ -93,21 +447,121 @@ public:
 	std::vector<Primitive>& GetPrimitives() { return mPrimitives; }
 	const std::vector<Primitive>& GetPrimitives() const { return mPrimitives; }
 
+	// Expected cost of a random ray query relative to the root box area
+	float GetSahCost(float costTraversal = 1.f, float costIntersect = 1.f) const;
+
+	// Entries of the fixed traversal stack of a query, deeper trees spill
+	// into the heap
+	static constexpr int kTraversalStackSize = 64;
+
 	//const Aabb& GetRootBox() const { assert(mNodes.size() > 0 && mNodes[0]); return mNodes[0]->bbox; }
 
 protected:
+	// Compute bounds of all primitives into mRefs in parallel
+	void PrepareRefs(
+		const std::vector<Primitive>& primitives,
+		const PrimitiveBound& bound);
+
+	// Sort mRefs along the Morton curve of their centroids
+	void SortRefsByMorton(int mortonBits, std::vector<uint64_t>& codes);
+
+	// Gather primitives in the final order of mRefs and free mRefs
+	void ReleaseRefs(const std::vector<Primitive>& primitives);
+
 	void BuildRecursive(
 		int beginId,
 		int endId,
 		int nodeId,
 		int depth,
-		const PrimitiveBound& bound,
 		const PrimitiveSplit& split);
 
+	// Parent links, level ordering and primitive to leaf map used by Refit
+	void PrepareRefit();
+
+	// Apply the best area-reducing rotation below an inner node if any
+	bool RotateNode(int nodeId);
+
+	// Recompute box of a leaf or inner node from its content
+	void RefitNode(const PrimitiveBound& bound, int nodeId);
+
+	void BuildSpatialRecursive(
+		SpatialBuild& ctx,
+		std::vector<PrimitiveRef>& refs,
+		int nodeId,
+		int depth);
+
+	// Closest hit within the subtree of rootId, whose box the ray must hit
+	template <class Collide, class Trace>
+	bool IntersectSubtree(
+		int rootId,
+		const Collide& collide,
+		const vec3& org,
+		const vec3& dir,
+		float& dist,
+		Trace& trace) const;
+
+	// Depth-first walk of the nodes whose box passes overlapNode(bbox),
+	// visiting leaf primitives whose triangle passes
+	// overlapTriangle(v0, v1, v2)
+	template <class OverlapNode, class OverlapTriangle>
+	void QueryRegion(
+		const PrimitiveTriangle& triangle,
+		const OverlapNode& overlapNode,
+		const OverlapTriangle& overlapTriangle,
+		const std::function<void(const Primitive&)>& visit) const;
+
+	// Simultaneous depth-first walk of the subtree of nodeId and the
+	// subtree of otherId in other, passing intersecting face pairs to visit
+	// until it returns false. Returns false if visit stopped it.
+	bool CollideSubtrees(
+		int nodeId,
+		int otherId,
+		const PrimitiveTriangle& triangle,
+		const Bvh& other,
+		const PrimitiveTriangle& otherTriangle,
+		const glm::mat4& transform,
+		const std::function<bool(const FacePair&)>& visit) const;
+
+	// CollideSubtrees(...) of two subtrees of this tree, the same one if
+	// nodeId == otherId, skipping faces that share a vertex
+	void SelfCollideSubtrees(
+		int nodeId,
+		int otherId,
+		const PrimitiveTriangle& triangle,
+		std::vector<FacePair>& pairs) const;
+
+	// KNearest into hits[0, k), returns the number of faces found
+	int KNearest(
+		const PrimitiveTriangle& triangle,
+		const vec3& p,
+		int k,
+		PointHit* hits) const;
+
+	// Trace numRays <= K coherent rays as one packet: every node is fetched
+	// once and tested against all active rays. Rays of mixed directions and
+	// the last active ray of a subtree continue as single rays.
+	template <int K>
+	void IntersectPacket(
+		const PrimitiveTriangle& triangle,
+		const Ray* rays,
+		RayHit* hits,
+		int numRays) const;
+
 protected:
+	std::vector<PrimitiveRef> mRefs; // primitive references while building
 	std::vector<Primitive> mPrimitives;
 	std::vector<BvhNode> mNodes;
+	std::atomic<int> mNumNodes{ 0 }; // nodes allocated so far while building
 	int mThreshold = 1;
+
+	// Refit data, built on first refit after construction
+	std::vector<int> mParents;      // parent of each node, -1 for root
+	std::vector<int> mLevels;       // depth of each node
+	std::vector<int> mLevelNodes;   // nodes sorted by depth
+	std::vector<int> mLevelOffsets; // first entry of each depth in mLevelNodes
+	std::vector<int> mPrimLeaves;   // leaf of each primitive slot
+	std::vector<int> mFaceOffsets;  // primitive slots of a face, CSR offsets
+	std::vector<int> mFaceSlots;    // primitive slots of a face, CSR values
 };
 
 inline int& Left(BvhNode& node) { return node.i0; }
@@ -131,4 +585,132 @@ inline bool IsLeaf(const BvhNode& node)
 	return NegLen(node) < 0;
 }
 
+inline void BvhTraceRecord::VisitNode(const BvhNode& node)
+{
+	BvhTraceCount::VisitNode(node);
+	bboxes.push_back(node.bbox);
+}
+
+// Test the primitives of a leaf one by one. Callbacks working on whole
+// leaves provide an overload found by argument-dependent lookup, see
+// BlockCollide.
+template <class Collide, class Trace>
+inline bool CollideLeaf(
+	const Collide& collide,
+	int /*nodeId*/,
+	const BvhNode& node,
+	const std::vector<Primitive>& primitives,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	Trace& trace)
+{
+	bool hit = false;
+	int beginId = Offset(node);
+	int endId = Offset(node) + Length(node);
+
+	for (int i = beginId; i < endId; ++i)
+	{
+		trace.TestPrimitive();
+		if (collide(primitives[i], org, dir, dist))
+			hit = true;
+	}
+
+	return hit;
+}
+
+template <class Collide, class Trace>
+bool Bvh::Intersect(
+	const Collide& collide,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	Trace& trace) const
+{
+	vec3 invDir = { 1.f / dir.x, 1.f / dir.y, 1.f / dir.z };
+	float t;
+
+	if (mNodes.empty() || !IsIntersecting(mNodes[0].bbox, org, invDir, dist, t))
+		return false;
+
+	return IntersectSubtree(0, collide, org, dir, dist, trace);
+}
+
+template <class Collide, class Trace>
+bool Bvh::IntersectSubtree(
+	int rootId,
+	const Collide& collide,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	Trace& trace) const
+{
+	// Far child to visit later with its entry distance
+	struct Entry
+	{
+		int nodeId;
+		float t;
+	};
+
+	// Deep enough for every builder; deeper trees spill into the heap
+	Entry stack[kTraversalStackSize];
+	std::vector<Entry> overflow;
+	int top = 0;
+
+	vec3 invDir = { 1.f / dir.x, 1.f / dir.y, 1.f / dir.z };
+	bool hit = false;
+	int curr = rootId;
+
+	while (true)
+	{
+		const BvhNode& node = mNodes[curr]; // safe
+		trace.VisitNode(node);
+
+		int next = -1;
+
+		if (IsLeaf(node))
+		{
+			if (CollideLeaf(collide, curr, node, mPrimitives, org, dir, dist, trace))
+				hit = true;
+		}
+		else
+		{
+			float tl, tr;
+			bool hitL = IsIntersecting(mNodes[Left(node)].bbox, org, invDir, dist, tl);
+			bool hitR = IsIntersecting(mNodes[Right(node)].bbox, org, invDir, dist, tr);
+
+			if (hitL && hitR)
+			{
+				// Visit the nearer child first, keep the other for later
+				Entry far = (tl <= tr) ? Entry{ Right(node), tr } : Entry{ Left(node), tl };
+				next = (tl <= tr) ? Left(node) : Right(node);
+
+				if (top < kTraversalStackSize) stack[top++] = far;
+				else overflow.push_back(far);
+			}
+			else if (hitL) next = Left(node);
+			else if (hitR) next = Right(node);
+		}
+
+		// Pop until an entry starts before the closest hit so far
+		while (next < 0 && (top > 0 || !overflow.empty()))
+		{
+			Entry entry;
+			if (!overflow.empty())
+			{
+				entry = overflow.back();
+				overflow.pop_back();
+			}
+			else entry = stack[--top];
+
+			if (entry.t < dist) next = entry.nodeId;
+		}
+
+		if (next < 0) break;
+		curr = next;
+	}
+
+	return hit;
+}
+
 #endif
\ No newline at end of file
@@ -10,6 +10,22 @@ bool IsIntersecting(
 	const vec3& dir,
 	float& dist,
 	bool enable_culling)
+{
+	float u, v;
+	return IsIntersecting(v0, v1, v2, org, dir, 0.f, dist, u, v, enable_culling);
+}
+
+bool IsIntersecting(
+	const vec3& v0,
+	const vec3& v1,
+	const vec3& v2,
+	const vec3& org,
+	const vec3& dir,
+	float tmin,
+	float& dist,
+	float& u,
+	float& v,
+	bool enable_culling)
 {
 	vec3 v01 = v1 - v0;
 	vec3 v02 = v2 - v0;
@@ -21,18 +37,18 @@ bool IsIntersecting(
 
 	float inv = 1 / det;
 	vec3 tvc = org - v0; // P0 - V0
-	float u = dot(tvc, pvc) * inv; // Eq.3
+	u = dot(tvc, pvc) * inv; // Eq.3
 	if (u < 0.0f || u > 1.0f) return false;
 
 	vec3 qvc = cross(tvc, v01); // S
-	float v = dot(dir, qvc) * inv; // Eq.4
+	v = dot(dir, qvc) * inv; // Eq.4
 	if (v < 0.0f || u + v > 1.0f) return false;
 
 	// distance from ray.origin to hit point
 	float t = dot(v02, qvc) * inv; // Eq.5
 
 	// update hit distance
-	if (t > 0.0f && dist > t)
+	if (t > tmin && dist > t)
 	{
 		dist = t;
 		return true; // ray hit primitive in distance
@@ -40,17 +56,277 @@ bool IsIntersecting(
 	else return false; // ray hit primitive out of distance
 }
 
+vec3 GetClosestPoint(
+	const vec3& v0,
+	const vec3& v1,
+	const vec3& v2,
+	const vec3& p,
+	float& u,
+	float& v)
+{
+	vec3 v01 = v1 - v0;
+	vec3 v02 = v2 - v0;
+
+	// vertex region of v0
+	vec3 p0 = p - v0;
+	float d1 = dot(v01, p0);
+	float d2 = dot(v02, p0);
+	if (d1 <= 0.f && d2 <= 0.f)
+	{
+		u = 0.f; v = 0.f;
+		return v0;
+	}
+
+	// vertex region of v1
+	vec3 p1 = p - v1;
+	float d3 = dot(v01, p1);
+	float d4 = dot(v02, p1);
+	if (d3 >= 0.f && d4 <= d3)
+	{
+		u = 1.f; v = 0.f;
+		return v1;
+	}
+
+	// edge region of v0 v1
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+	{
+		u = d1 / (d1 - d3); v = 0.f;
+		return v0 + v01 * u;
+	}
+
+	// vertex region of v2
+	vec3 p2 = p - v2;
+	float d5 = dot(v01, p2);
+	float d6 = dot(v02, p2);
+	if (d6 >= 0.f && d5 <= d6)
+	{
+		u = 0.f; v = 1.f;
+		return v2;
+	}
+
+	// edge region of v0 v2
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+	{
+		u = 0.f; v = d2 / (d2 - d6);
+		return v0 + v02 * v;
+	}
+
+	// edge region of v1 v2
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.f && d4 - d3 >= 0.f && d5 - d6 >= 0.f)
+	{
+		v = (d4 - d3) / ((d4 - d3) + (d5 - d6)); u = 1.f - v;
+		return v1 + (v2 - v1) * v;
+	}
+
+	// face region
+	float inv = 1 / (va + vb + vc);
+	u = vb * inv;
+	v = vc * inv;
+	return v0 + v01 * u + v02 * v;
+}
+
+bool IsOverlapping(
+	const vec3& v0,
+	const vec3& v1,
+	const vec3& v2,
+	const Aabb& b)
+{
+	// box axes
+	if (!IsOverlapping(Bound(v0, v1, v2), b)) return false;
+
+	// triangle relative to the box center
+	vec3 c = GetCentroid(b);
+	vec3 h = GetDiagonal(b) * 0.5f;
+	vec3 p[3] = { v0 - c, v1 - c, v2 - c };
+	vec3 e[3] = { p[1] - p[0], p[2] - p[1], p[0] - p[2] };
+
+	// Projections of the triangle and the box on axis are disjoint
+	auto separates = [&](const vec3& axis)
+	{
+		float d0 = dot(p[0], axis), d1 = dot(p[1], axis), d2 = dot(p[2], axis);
+		float r = dot(h, glm::abs(axis));
+		return std::min(d0, std::min(d1, d2)) > r || std::max(d0, std::max(d1, d2)) < -r;
+	};
+
+	// triangle normal
+	if (separates(cross(e[0], e[1]))) return false;
+
+	// box axes crossed with triangle edges
+	for (int i = 0; i < 3; ++i)
+	{
+		if (separates(vec3(0.f, -e[i].z, e[i].y))) return false;
+		if (separates(vec3(e[i].z, 0.f, -e[i].x))) return false;
+		if (separates(vec3(-e[i].y, e[i].x, 0.f))) return false;
+	}
+
+	return true;
+}
+
+// Whether segment p q meets triangle v0, v1, v2, segments parallel to
+// the plane rejected
+static bool IsSegmentIntersecting(
+	const vec3& p,
+	const vec3& q,
+	const vec3& v0,
+	const vec3& v1,
+	const vec3& v2)
+{
+	vec3 dir = q - p;
+	vec3 v01 = v1 - v0;
+	vec3 v02 = v2 - v0;
+	vec3 pvc = cross(dir, v02);
+	float det = dot(v01, pvc);
+	if (det == 0.f) return false;
+
+	float inv = 1 / det;
+	vec3 tvc = p - v0;
+	float u = dot(tvc, pvc) * inv;
+	if (u < 0.f || u > 1.f) return false;
+
+	vec3 qvc = cross(tvc, v01);
+	float v = dot(dir, qvc) * inv;
+	if (v < 0.f || u + v > 1.f) return false;
+
+	float t = dot(v02, qvc) * inv;
+	return t >= 0.f && t <= 1.f;
+}
+
+// Interval [t0, t1] along axis where triangle v cuts the plane of signed
+// vertex distances d, for d neither all zero nor all of one strict sign
+static void GetInterval(const vec3 (&v)[3], const float (&d)[3], int axis, float& t0, float& t1)
+{
+	// vertex alone on its side of the plane
+	int k;
+	if (d[0] * d[1] > 0.f) k = 2;
+	else if (d[0] * d[2] > 0.f) k = 1;
+	else if (d[1] * d[2] > 0.f || d[0] != 0.f) k = 0;
+	else if (d[1] != 0.f) k = 1;
+	else k = 2;
+
+	int i = (k + 1) % 3, j = (k + 2) % 3;
+	float pk = v[k][axis], pi = v[i][axis], pj = v[j][axis];
+	t0 = pi + (pk - pi) * d[i] / (d[i] - d[k]);
+	t1 = pj + (pk - pj) * d[j] / (d[j] - d[k]);
+	if (t0 > t1) std::swap(t0, t1);
+}
+
+// Sign of the 2D cross product of b - a and c - a
+static float Orient2(const glm::vec2& a, const glm::vec2& b, const glm::vec2& c)
+{
+	return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+static bool IsInside2(const glm::vec2& p, const glm::vec2 (&t)[3])
+{
+	float d0 = Orient2(t[0], t[1], p);
+	float d1 = Orient2(t[1], t[2], p);
+	float d2 = Orient2(t[2], t[0], p);
+	return (d0 >= 0.f && d1 >= 0.f && d2 >= 0.f) || (d0 <= 0.f && d1 <= 0.f && d2 <= 0.f);
+}
+
+static bool IsSegmentIntersecting2(const glm::vec2& p0, const glm::vec2& p1, const glm::vec2& q0, const glm::vec2& q1)
+{
+	float d0 = Orient2(q0, q1, p0), d1 = Orient2(q0, q1, p1);
+	float d2 = Orient2(p0, p1, q0), d3 = Orient2(p0, p1, q1);
+	if (d0 * d1 > 0.f || d2 * d3 > 0.f) return false;
+
+	// collinear: overlap of the projections on both axes
+	if (d0 == 0.f && d1 == 0.f)
+		return
+			std::max(std::min(p0.x, p1.x), std::min(q0.x, q1.x)) <= std::min(std::max(p0.x, p1.x), std::max(q0.x, q1.x)) &&
+			std::max(std::min(p0.y, p1.y), std::min(q0.y, q1.y)) <= std::min(std::max(p0.y, p1.y), std::max(q0.y, q1.y));
+
+	return true;
+}
+
+bool IsIntersecting(
+	const vec3& a0,
+	const vec3& a1,
+	const vec3& a2,
+	const vec3& b0,
+	const vec3& b1,
+	const vec3& b2)
+{
+	vec3 a[3] = { a0, a1, a2 };
+	vec3 b[3] = { b0, b1, b2 };
+
+	// separated by the plane of either triangle
+	vec3 nb = cross(b1 - b0, b2 - b0);
+	float da[3] = { dot(nb, a0 - b0), dot(nb, a1 - b0), dot(nb, a2 - b0) };
+	if ((da[0] > 0.f && da[1] > 0.f && da[2] > 0.f) || (da[0] < 0.f && da[1] < 0.f && da[2] < 0.f))
+		return false;
+
+	vec3 na = cross(a1 - a0, a2 - a0);
+	float db[3] = { dot(na, b0 - a0), dot(na, b1 - a0), dot(na, b2 - a0) };
+	if ((db[0] > 0.f && db[1] > 0.f && db[2] > 0.f) || (db[0] < 0.f && db[1] < 0.f && db[2] < 0.f))
+		return false;
+
+	// zero area: edges of the degenerate triangle as segments
+	if (na == vec3(0.f) || nb == vec3(0.f))
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			if (IsSegmentIntersecting(a[i], a[(i + 1) % 3], b0, b1, b2)) return true;
+			if (IsSegmentIntersecting(b[i], b[(i + 1) % 3], a0, a1, a2)) return true;
+		}
+		return false;
+	}
+
+	bool coplanar =
+		(da[0] == 0.f && da[1] == 0.f && da[2] == 0.f) ||
+		(db[0] == 0.f && db[1] == 0.f && db[2] == 0.f);
+
+	if (!coplanar)
+	{
+		// Both triangles cut the line where the planes meet in an interval,
+		// from the signed distances already known; they intersect if the
+		// intervals overlap (Moller 1997). Unlike edge-triangle tests this
+		// stays consistent for edges lying in the other plane.
+		vec3 dir = glm::abs(cross(na, nb));
+		int axis = (dir.x >= dir.y && dir.x >= dir.z) ? 0 : (dir.y >= dir.z ? 1 : 2);
+
+		float ta0, ta1, tb0, tb1;
+		GetInterval(a, da, axis, ta0, ta1);
+		GetInterval(b, db, axis, tb0, tb1);
+
+		return std::max(ta0, tb0) <= std::min(ta1, tb1);
+	}
+
+	// coplanar: drop the dominant axis of the normal
+	vec3 n = glm::abs(nb);
+	int k = (n.x >= n.y && n.x >= n.z) ? 0 : (n.y >= n.z ? 1 : 2);
+	int x = (k + 1) % 3;
+	int y = (k + 2) % 3;
+	glm::vec2 p[3], q[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		p[i] = { a[i][x], a[i][y] };
+		q[i] = { b[i][x], b[i][y] };
+	}
+
+	for (int i = 0; i < 3; ++i)
+		for (int j = 0; j < 3; ++j)
+			if (IsSegmentIntersecting2(p[i], p[(i + 1) % 3], q[j], q[(j + 1) % 3]))
+				return true;
+
+	return IsInside2(p[0], q) || IsInside2(q[0], p);
+}
+
 OpenMesh::FaceHandle Collider::collide(
 	const vec3& org,
 	const vec3& dir,
 	float& dist) const
 {
 	Primitive ret;
-	PrimitiveTriangle triangle(*pMesh);
+	PrimitiveTriangle triangle(*pTriangles);
 	int numIntersectPri = 0;
 
-	for (Primitive vF : pMesh->faces())
+	for (int i = 0; i < pTriangles->GetNumFaces(); ++i)
 	{
+		Primitive vF(i);
 		vec3 v0, v1, v2;
 		triangle(vF, v0, v1, v2);
 
@@ -71,8 +347,6 @@ Primitive Collider::collide(
 	const vec3& dir,
 	float& dist) const
 {
-	PrimitiveTriangle triangle(*pMesh);
-	PrimitiveCollide collide(triangle);
-	bvh.Intersect(collide, org, dir, dist);
-	return collide.closest;
+	BvhTraceNone trace;
+	return collide(bvh, org, dir, dist, trace);
 }
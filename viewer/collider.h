@@ -11,11 +11,11 @@ class Collider
 public:
     Collider() {}
 
-    Collider(TheMesh* _pMesh) { set_mesh(_pMesh); }
+    Collider(const TriangleBuffer* _pTriangles) { set_triangles(_pTriangles); }
 
-    void set_mesh(TheMesh* _pMesh) { pMesh = _pMesh; }
+    void set_triangles(const TriangleBuffer* _pTriangles) { pTriangles = _pTriangles; }
 
-    void unset_mesh() { pMesh = NULL; }
+    void unset_triangles() { pTriangles = NULL; }
 
     Primitive collide(
         const vec3& org,
@@ -28,8 +28,23 @@ public:
         const vec3& dir,
         float& dist) const;
 
+    // Bvh query with instrumentation policy, see BvhTraceNone
+    template <class Trace>
+    Primitive collide(
+        const Bvh& bvh,
+        const vec3& org,
+        const vec3& dir,
+        float& dist,
+        Trace& trace) const
+    {
+        PrimitiveTriangle triangle(*pTriangles);
+        PrimitiveCollide collide(triangle);
+        bvh.Intersect(collide, org, dir, dist, trace);
+        return collide.closest;
+    }
+
 protected:
-    TheMesh* pMesh = NULL;
+    const TriangleBuffer* pTriangles = NULL;
 };
 
 bool IsIntersecting(
@@ -41,4 +56,49 @@ bool IsIntersecting(
     float& dist,
     bool enable_culling = false);
 
+// Same test accepting hits within (tmin, dist), also returns barycentrics
+// u, v of the hit point w.r.t. v1 and v2
+bool IsIntersecting(
+    const vec3& v0,
+    const vec3& v1,
+    const vec3& v2,
+    const vec3& org,
+    const vec3& dir,
+    float tmin,
+    float& dist,
+    float& u,
+    float& v,
+    bool enable_culling = false);
+
+// Point of triangle v0, v1, v2 closest to p, with its barycentrics u, v
+// w.r.t. v1 and v2 (Ericson 2005, 5.1.5)
+vec3 GetClosestPoint(
+    const vec3& v0,
+    const vec3& v1,
+    const vec3& v2,
+    const vec3& p,
+    float& u,
+    float& v);
+
+// Whether triangle v0, v1, v2 overlaps box b, separating axis test of the
+// box axes, the triangle normal and the 9 edge cross products
+// (Akenine-Moller 2001)
+bool IsOverlapping(
+    const vec3& v0,
+    const vec3& v1,
+    const vec3& v2,
+    const Aabb& b);
+
+// Whether triangles a0, a1, a2 and b0, b1, b2 intersect, touching
+// included. Crossing triangles are compared on the line where their
+// planes meet, coplanar ones in 2D on the plane, and the edges of a
+// zero-area one as segments.
+bool IsIntersecting(
+    const vec3& a0,
+    const vec3& a1,
+    const vec3& a2,
+    const vec3& b0,
+    const vec3& b1,
+    const vec3& b2);
+
 #endif // !COLLIDER_H
@@ -0,0 +1,252 @@
+#include "bvh.h"
+
+#include "collider.h" // IsIntersecting(...)
+#include "simd.h"
+
+// Rays of a packet as structure of arrays, one lane per ray
+template <int K>
+struct alignas(64) RayPacket
+{
+	float org[3][K];
+	float invDir[3][K];
+	float tmax[K]; // closest hit so far, -FLT_MAX for unused lanes
+};
+
+// Slab test of one box against all lanes, same condition as
+// IsIntersecting(Aabb, ...) of aabb.hpp. Operands of min/max are ordered
+// to treat NaN (ray parallel to and on a slab plane) like std::min/max.
+// Returns bit mask of hit lanes.
+template <int K>
+static inline int IntersectPacketBox(const Aabb& b, const RayPacket<K>& p)
+{
+	int mask = 0;
+	int i = 0;
+
+#if defined(SIMD_AVX512)
+	for (; i + 16 <= K; i += 16)
+	{
+		__m512 t0 = _mm512_set1_ps(-FLT_MAX);
+		__m512 t1 = _mm512_set1_ps(FLT_MAX);
+
+		for (int a = 0; a < 3; ++a)
+		{
+			__m512 o = _mm512_loadu_ps(p.org[a] + i);
+			__m512 inv = _mm512_loadu_ps(p.invDir[a] + i);
+			__m512 ta = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(b.pMin[a]), o), inv);
+			__m512 tb = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(b.pMax[a]), o), inv);
+			t0 = _mm512_max_ps(_mm512_min_ps(tb, ta), t0);
+			t1 = _mm512_min_ps(_mm512_max_ps(tb, ta), t1);
+		}
+
+		__mmask16 hit =
+			_mm512_cmp_ps_mask(t1, _mm512_setzero_ps(), _CMP_GT_OQ) &
+			_mm512_cmp_ps_mask(t1, t0, _CMP_GE_OQ) &
+			_mm512_cmp_ps_mask(t0, _mm512_loadu_ps(p.tmax + i), _CMP_LT_OQ);
+		mask |= static_cast<int>(hit) << i;
+	}
+#endif
+
+#if defined(SIMD_AVX)
+	for (; i + 8 <= K; i += 8)
+	{
+		__m256 t0 = _mm256_set1_ps(-FLT_MAX);
+		__m256 t1 = _mm256_set1_ps(FLT_MAX);
+
+		for (int a = 0; a < 3; ++a)
+		{
+			__m256 o = _mm256_loadu_ps(p.org[a] + i);
+			__m256 inv = _mm256_loadu_ps(p.invDir[a] + i);
+			__m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.pMin[a]), o), inv);
+			__m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.pMax[a]), o), inv);
+			t0 = _mm256_max_ps(_mm256_min_ps(tb, ta), t0);
+			t1 = _mm256_min_ps(_mm256_max_ps(tb, ta), t1);
+		}
+
+		__m256 hit = _mm256_and_ps(
+			_mm256_and_ps(
+				_mm256_cmp_ps(t1, _mm256_setzero_ps(), _CMP_GT_OQ),
+				_mm256_cmp_ps(t1, t0, _CMP_GE_OQ)),
+			_mm256_cmp_ps(t0, _mm256_loadu_ps(p.tmax + i), _CMP_LT_OQ));
+		mask |= _mm256_movemask_ps(hit) << i;
+	}
+#endif
+
+#if defined(SIMD_SSE)
+	for (; i + 4 <= K; i += 4)
+	{
+		__m128 t0 = _mm_set1_ps(-FLT_MAX);
+		__m128 t1 = _mm_set1_ps(FLT_MAX);
+
+		for (int a = 0; a < 3; ++a)
+		{
+			__m128 o = _mm_loadu_ps(p.org[a] + i);
+			__m128 inv = _mm_loadu_ps(p.invDir[a] + i);
+			__m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMin[a]), o), inv);
+			__m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMax[a]), o), inv);
+			t0 = _mm_max_ps(_mm_min_ps(tb, ta), t0);
+			t1 = _mm_min_ps(_mm_max_ps(tb, ta), t1);
+		}
+
+		__m128 hit = _mm_and_ps(
+			_mm_and_ps(
+				_mm_cmpgt_ps(t1, _mm_setzero_ps()),
+				_mm_cmpge_ps(t1, t0)),
+			_mm_cmplt_ps(t0, _mm_loadu_ps(p.tmax + i)));
+		mask |= _mm_movemask_ps(hit) << i;
+	}
+#endif
+
+	for (; i < K; ++i)
+	{
+		float t0 = -FLT_MAX, t1 = FLT_MAX;
+
+		for (int a = 0; a < 3; ++a)
+		{
+			float ta = (b.pMin[a] - p.org[a][i]) * p.invDir[a][i];
+			float tb = (b.pMax[a] - p.org[a][i]) * p.invDir[a][i];
+			t0 = std::max(t0, std::min(ta, tb));
+			t1 = std::min(t1, std::max(ta, tb));
+		}
+
+		if (t1 > 0 && t1 >= t0 && p.tmax[i] > t0)
+			mask |= 1 << i;
+	}
+
+	return mask;
+}
+
+// Index of the lowest set bit
+static inline int LowestBit(int mask)
+{
+	int i = 0;
+	while (!(mask & (1 << i))) ++i;
+	return i;
+}
+
+template <int K>
+void Bvh::IntersectPacket(
+	const PrimitiveTriangle& triangle,
+	const Ray* rays,
+	RayHit* hits,
+	int numRays) const
+{
+	BvhTraceNone trace;
+	RayPacket<K> packet;
+	int octant = -1;
+	bool coherent = true;
+
+	for (int l = 0; l < K; ++l)
+	{
+		bool used = l < numRays;
+		vec3 org = used ? rays[l].org : vec3(0.f);
+		vec3 dir = used ? rays[l].dir : vec3(1.f);
+
+		for (int a = 0; a < 3; ++a)
+		{
+			packet.org[a][l] = org[a];
+			packet.invDir[a][l] = used ? 1.f / dir[a] : 0.f;
+		}
+		packet.tmax[l] = used ? rays[l].tmax : -FLT_MAX;
+
+		if (!used) continue;
+		hits[l] = RayHit();
+
+		// Directions of all rays must point into the same octant
+		int o = (dir.x < 0) | (dir.y < 0) << 1 | (dir.z < 0) << 2;
+		if (octant >= 0 && o != octant) coherent = false;
+		octant = o;
+	}
+
+	// Continue ray l alone from the subtree of nodeId
+	auto traceSingle = [&](int l, int nodeId)
+	{
+		PrimitiveHit context(triangle, rays[l].tmin);
+		float dist = packet.tmax[l];
+
+		if (IntersectSubtree(nodeId, context, rays[l].org, rays[l].dir, dist, trace))
+		{
+			hits[l] = context.hit;
+			packet.tmax[l] = dist;
+		}
+	};
+
+	if (mNodes.empty()) return;
+
+	if (!coherent)
+	{
+		for (int l = 0; l < numRays; ++l)
+		{
+			vec3 invDir(packet.invDir[0][l], packet.invDir[1][l], packet.invDir[2][l]);
+			float t;
+			if (IsIntersecting(mNodes[0].bbox, rays[l].org, invDir, packet.tmax[l], t))
+				traceSingle(l, 0);
+		}
+		return;
+	}
+
+	int stack[kTraversalStackSize];
+	std::vector<int> overflow;
+	int top = 0;
+	int curr = 0;
+
+	while (true)
+	{
+		const BvhNode& node = mNodes[curr]; // fetched once for all lanes
+		int mask = IntersectPacketBox(node.bbox, packet);
+
+		if (mask && !(mask & (mask - 1)) && !IsLeaf(node))
+		{
+			// Diverged: a single active ray traverses faster alone
+			traceSingle(LowestBit(mask), curr);
+		}
+		else if (mask && IsLeaf(node))
+		{
+			int beginId = Offset(node);
+			int endId = Offset(node) + Length(node);
+
+			for (int i = beginId; i < endId; ++i)
+			{
+				vec3 v0, v1, v2;
+				triangle(mPrimitives[i], v0, v1, v2);
+
+				for (int l = 0; l < numRays; ++l)
+				{
+					if (!(mask & (1 << l))) continue;
+
+					float u, v;
+					float dist = packet.tmax[l];
+					if (IsIntersecting(v0, v1, v2, rays[l].org, rays[l].dir, rays[l].tmin, dist, u, v))
+					{
+						hits[l] = { mPrimitives[i].idx(), dist, u, v };
+						packet.tmax[l] = dist;
+					}
+				}
+			}
+		}
+		else if (mask)
+		{
+			// Near child first along the common direction of the packet
+			int dim = GetMaxExtentDim(node.bbox);
+			int near = (octant >> dim & 1) ? Right(node) : Left(node);
+			int far = (octant >> dim & 1) ? Left(node) : Right(node);
+
+			if (top < kTraversalStackSize) stack[top++] = far;
+			else overflow.push_back(far);
+
+			curr = near;
+			continue;
+		}
+
+		if (!overflow.empty())
+		{
+			curr = overflow.back();
+			overflow.pop_back();
+		}
+		else if (top > 0) curr = stack[--top];
+		else break;
+	}
+}
+
+template void Bvh::IntersectPacket<4>(const PrimitiveTriangle&, const Ray*, RayHit*, int) const;
+template void Bvh::IntersectPacket<8>(const PrimitiveTriangle&, const Ray*, RayHit*, int) const;
+template void Bvh::IntersectPacket<16>(const PrimitiveTriangle&, const Ray*, RayHit*, int) const;
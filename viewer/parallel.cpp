@@ -0,0 +1,213 @@
+#include "parallel.h"
+
+// Queue owned by the current thread, 0 for threads outside of the pool
+static thread_local int tQueueId = 0;
+
+TaskPool& TaskPool::Instance()
+{
+	static TaskPool pool;
+	return pool;
+}
+
+TaskPool::TaskPool()
+{
+	unsigned int n = std::thread::hardware_concurrency();
+	SetNumThreads(n > 0 ? static_cast<int>(n) : 1);
+}
+
+TaskPool::~TaskPool()
+{
+	Stop();
+}
+
+void TaskPool::SetNumThreads(int numThreads)
+{
+	Stop();
+
+	numThreads = std::max(numThreads, 1);
+	mStop = false;
+	mQueues.clear();
+
+	for (int i = 0; i < numThreads; ++i)
+		mQueues.emplace_back(new Queue);
+
+	for (int i = 1; i < numThreads; ++i)
+		mWorkers.emplace_back(&TaskPool::WorkerLoop, this, i);
+}
+
+void TaskPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mStop = true;
+	}
+	mWake.notify_all();
+
+	for (std::thread& worker : mWorkers)
+		worker.join();
+
+	mWorkers.clear();
+}
+
+void TaskPool::Push(Task task)
+{
+	int queueId = (tQueueId < static_cast<int>(mQueues.size())) ? tQueueId : 0;
+	Queue& queue = *mQueues[queueId];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(std::move(task));
+	}
+	++mNumPending;
+	mWake.notify_one();
+}
+
+bool TaskPool::Pop(int queueId, Task& task)
+{
+	Queue& queue = *mQueues[queueId];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty()) return false;
+	task = std::move(queue.tasks.back());
+	queue.tasks.pop_back();
+	--mNumPending;
+	return true;
+}
+
+bool TaskPool::Steal(int thiefId, Task& task)
+{
+	int numQueues = static_cast<int>(mQueues.size());
+
+	for (int k = 1; k < numQueues; ++k)
+	{
+		Queue& queue = *mQueues[(thiefId + k) % numQueues];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty()) continue;
+		task = std::move(queue.tasks.front());
+		queue.tasks.pop_front();
+		--mNumPending;
+		return true;
+	}
+
+	return false;
+}
+
+bool TaskPool::RunOne()
+{
+	int queueId = (tQueueId < static_cast<int>(mQueues.size())) ? tQueueId : 0;
+	Task task;
+
+	if (Pop(queueId, task) || Steal(queueId, task))
+	{
+		task();
+		return true;
+	}
+
+	return false;
+}
+
+void TaskPool::WorkerLoop(int workerId)
+{
+	tQueueId = workerId;
+
+	while (!mStop)
+	{
+		if (RunOne()) continue;
+
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mWake.wait_for(lock, std::chrono::milliseconds(1),
+			[this]() { return mStop || mNumPending > 0; });
+	}
+}
+
+void TaskGroup::Run(TaskPool::Task task)
+{
+	++mNumPending;
+	TaskPool::Instance().Push([this, task]()
+	{
+		task();
+		--mNumPending;
+	});
+}
+
+void TaskGroup::Wait()
+{
+	TaskPool& pool = TaskPool::Instance();
+
+	while (mNumPending > 0)
+		if (!pool.RunOne())
+			std::this_thread::yield();
+}
+
+void ParallelFor(int beginId, int endId, int grain, const std::function<void(int, int)>& body)
+{
+	grain = std::max(grain, 1);
+	int numChunks = GetNumChunks(beginId, endId, grain);
+
+	if (numChunks <= 1 || TaskPool::Instance().GetNumThreads() == 1)
+	{
+		for (int b = beginId; b < endId; b += grain)
+			body(b, std::min(b + grain, endId));
+		return;
+	}
+
+	TaskGroup group;
+
+	for (int b = beginId; b < endId; b += grain)
+	{
+		int e = std::min(b + grain, endId);
+		group.Run([&body, b, e]() { body(b, e); });
+	}
+
+	group.Wait();
+}
+
+void ParallelRadixSort(std::vector<uint64_t>& keys, std::vector<int>& values, int numBits)
+{
+	constexpr int kRadixBits = 8;
+	constexpr int kRadix = 1 << kRadixBits;
+	constexpr int kGrain = 65536;
+
+	int n = static_cast<int>(keys.size());
+	int numChunks = std::max(GetNumChunks(0, n, kGrain), 1);
+	std::vector<uint64_t> keysTemp(n);
+	std::vector<int> valuesTemp(n);
+	std::vector<int> offsets(numChunks * kRadix);
+
+	for (int shift = 0; shift < numBits; shift += kRadixBits)
+	{
+		// Histogram of digits in each chunk
+		std::fill(offsets.begin(), offsets.end(), 0);
+
+		ParallelFor(0, n, kGrain, [&](int b, int e)
+		{
+			int* count = &offsets[b / kGrain * kRadix];
+			for (int i = b; i < e; ++i)
+				++count[(keys[i] >> shift) & (kRadix - 1)];
+		});
+
+		// Exclusive scan in digit-major order so that chunks scatter stably
+		int sum = 0;
+		for (int digit = 0; digit < kRadix; ++digit)
+		{
+			for (int chunk = 0; chunk < numChunks; ++chunk)
+			{
+				int count = offsets[chunk * kRadix + digit];
+				offsets[chunk * kRadix + digit] = sum;
+				sum += count;
+			}
+		}
+
+		ParallelFor(0, n, kGrain, [&](int b, int e)
+		{
+			int* offset = &offsets[b / kGrain * kRadix];
+			for (int i = b; i < e; ++i)
+			{
+				int dst = offset[(keys[i] >> shift) & (kRadix - 1)]++;
+				keysTemp[dst] = keys[i];
+				valuesTemp[dst] = values[i];
+			}
+		});
+
+		keys.swap(keysTemp);
+		values.swap(valuesTemp);
+	}
+}
@@ -0,0 +1,137 @@
+#pragma once
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing task pool.
+// Every worker owns a deque: it pushes and pops its own tasks at the back
+// (depth-first, cache friendly) and steals from the front of the others'
+// (breadth-first, large chunks of work). Threads outside the pool share
+// queue 0 and help executing tasks while they wait on a TaskGroup.
+class TaskPool
+{
+public:
+	using Task = std::function<void()>;
+
+	static TaskPool& Instance();
+
+	// Number of threads executing tasks, including the calling thread
+	void SetNumThreads(int numThreads);
+	int GetNumThreads() const { return static_cast<int>(mWorkers.size()) + 1; }
+
+	void Push(Task task);
+
+	// Execute one pending task if any, returns false if none was found
+	bool RunOne();
+
+	~TaskPool();
+
+protected:
+	TaskPool();
+
+	bool Pop(int queueId, Task& task);
+	bool Steal(int thiefId, Task& task);
+	void WorkerLoop(int workerId);
+	void Stop();
+
+protected:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> mQueues;
+	std::vector<std::thread> mWorkers;
+	std::atomic<int> mNumPending{ 0 };
+	std::atomic<bool> mStop{ false };
+	std::mutex mSleepMutex;
+	std::condition_variable mWake;
+};
+
+// Set of tasks to wait on. Waiting thread executes pending tasks (its own
+// or stolen ones) instead of blocking, so groups can be nested freely.
+class TaskGroup
+{
+public:
+	void Run(TaskPool::Task task);
+	void Wait();
+
+	~TaskGroup() { Wait(); }
+
+protected:
+	std::atomic<int> mNumPending{ 0 };
+};
+
+// Call body(b, e) on consecutive sub-ranges of [beginId, endId) of about
+// grain elements each.
+void ParallelFor(int beginId, int endId, int grain, const std::function<void(int, int)>& body);
+
+inline int GetNumChunks(int beginId, int endId, int grain)
+{
+	return (endId - beginId + grain - 1) / grain;
+}
+
+// Sort values by the lowest numBits bits of their keys with a parallel
+// LSD radix sort of 8-bit digits. Both arrays are permuted.
+void ParallelRadixSort(std::vector<uint64_t>& keys, std::vector<int>& values, int numBits);
+
+// Partition [beginId, endId) of an array by predicate in parallel, keeping
+// relative order on both sides. Returns index of the first element for
+// which the predicate is false.
+template <class T, class Pred>
+int ParallelPartition(std::vector<T>& items, int beginId, int endId, int grain, Pred pred)
+{
+	int numChunks = GetNumChunks(beginId, endId, grain);
+
+	if (numChunks <= 1)
+	{
+		auto iter = std::stable_partition(items.begin() + beginId, items.begin() + endId, pred);
+		return static_cast<int>(std::distance(items.begin(), iter));
+	}
+
+	std::vector<int> numLeft(numChunks + 1, 0);
+	std::vector<char> isLeft(endId - beginId);
+
+	ParallelFor(beginId, endId, grain, [&](int b, int e)
+	{
+		int count = 0;
+		for (int i = b; i < e; ++i)
+			count += (isLeft[i - beginId] = pred(items[i]) ? 1 : 0);
+		numLeft[(b - beginId) / grain + 1] = count;
+	});
+
+	for (int i = 0; i < numChunks; ++i)
+		numLeft[i + 1] += numLeft[i];
+
+	int totalLeft = numLeft[numChunks];
+	std::vector<T> temp(endId - beginId);
+
+	ParallelFor(beginId, endId, grain, [&](int b, int e)
+	{
+		int chunk = (b - beginId) / grain;
+		int l = numLeft[chunk];
+		int r = totalLeft + (b - beginId) - numLeft[chunk];
+		for (int i = b; i < e; ++i)
+			temp[isLeft[i - beginId] ? l++ : r++] = items[i];
+	});
+
+	ParallelFor(beginId, endId, grain, [&](int b, int e)
+	{
+		std::copy(temp.begin() + (b - beginId), temp.begin() + (e - beginId), items.begin() + b);
+	});
+
+	return beginId + totalLeft;
+}
+
+#endif // !PARALLEL_H
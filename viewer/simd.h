@@ -0,0 +1,22 @@
+#pragma once
+#ifndef SIMD_H
+#define SIMD_H
+
+// Instruction sets available to the SIMD kernels. SSE2 is baseline on
+// x86-64; AVX and AVX-512 follow the compiler flags, see ENABLE_AVX2 and
+// ENABLE_AVX512 in CMakeLists.txt.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE 1
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define SIMD_AVX 1
+#endif
+
+#if defined(__AVX512F__)
+#define SIMD_AVX512 1
+#endif
+
+#endif // !SIMD_H
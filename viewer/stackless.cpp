@@ -0,0 +1,56 @@
+#include "stackless.h"
+
+void StacklessBvh::Build(const Bvh& bvh)
+{
+	const std::vector<BvhNode>& nodes = bvh.GetNodes();
+
+	mNodes.clear();
+	mNodes.reserve(nodes.size());
+	mPrimitives = bvh.GetPrimitives();
+
+	if (nodes.empty()) return;
+
+	// Pre-order walk; the skip link of an inner node is known once its
+	// subtree has been emitted, which happens when its right child is
+	// popped (left subtree done) and at the end (right subtree done)
+	struct Entry
+	{
+		int nodeId;  // node of bvh to emit
+		int parent;  // emitted parent whose right child it is, or -1
+	};
+
+	std::vector<Entry> stack = { { 0, -1 } };
+	std::vector<int> open; // emitted inner nodes waiting for their skip link
+
+	while (!stack.empty())
+	{
+		Entry entry = stack.back();
+		stack.pop_back();
+
+		int curr = static_cast<int>(mNodes.size());
+		const BvhNode& node = nodes[entry.nodeId];
+
+		// Every open node emitted after the parent has its subtree done
+		if (entry.parent >= 0)
+		{
+			Right(mNodes[entry.parent]) = curr;
+			while (open.back() != entry.parent)
+			{
+				Skip(mNodes[open.back()]) = curr;
+				open.pop_back();
+			}
+		}
+
+		mNodes.push_back(node);
+
+		if (!IsLeaf(node))
+		{
+			open.push_back(curr);
+			stack.push_back({ Right(node), curr });
+			stack.push_back({ Left(node), -1 });
+		}
+	}
+
+	for (int id : open)
+		Skip(mNodes[id]) = static_cast<int>(mNodes.size());
+}
@@ -0,0 +1,80 @@
+#pragma once
+#ifndef STACKLESS_BOUNDING_VOLUME_HIERARCHY_H
+#define STACKLESS_BOUNDING_VOLUME_HIERARCHY_H
+
+#include "bvh.h"
+
+// Binary Bvh relaid out in depth-first order for traversal without a
+// stack. The left child of an inner node is always the next node, so the
+// node keeps its size and i0 holds the skip link instead: the node
+// following the subtree, where traversal goes on after a miss.
+// Inner node: i0 = skip, i1 = right child;
+// leaf: i0 = beginning index in the primitive array, i1 = -count, skip is
+// the next node.
+// The last skip link is the number of nodes and ends the traversal.
+class StacklessBvh
+{
+public:
+	// Copy the topology of a built Bvh, left child first
+	void Build(const Bvh& bvh);
+
+	// Closest hit. Visits children in fixed left-right order instead of
+	// near-to-far but finds the same distance as Bvh::Intersect(...).
+	// The node id passed to CollideLeaf(...) is the one of this tree.
+	template <class Collide, class Trace>
+	bool Intersect(
+		const Collide& collide,
+		const vec3& org,
+		const vec3& dir,
+		float& dist,
+		Trace& trace) const;
+
+	const std::vector<BvhNode>& GetNodes() const { return mNodes; }
+	const std::vector<Primitive>& GetPrimitives() const { return mPrimitives; }
+
+protected:
+	std::vector<BvhNode> mNodes;
+	std::vector<Primitive> mPrimitives;
+};
+
+inline int& Skip(BvhNode& node) { return node.i0; }
+inline const int& Skip(const BvhNode& node) { return node.i0; }
+
+template <class Collide, class Trace>
+bool StacklessBvh::Intersect(
+	const Collide& collide,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	Trace& trace) const
+{
+	// The whole state of a query in flight: current node and closest hit
+	int numNodes = static_cast<int>(mNodes.size());
+	int curr = 0;
+	bool hit = false;
+
+	vec3 invDir = { 1.f / dir.x, 1.f / dir.y, 1.f / dir.z };
+
+	while (curr < numNodes)
+	{
+		const BvhNode& node = mNodes[curr];
+		float t;
+
+		if (!IsIntersecting(node.bbox, org, invDir, dist, t))
+		{
+			curr = IsLeaf(node) ? curr + 1 : Skip(node);
+			continue;
+		}
+
+		trace.VisitNode(node);
+
+		if (IsLeaf(node) && CollideLeaf(collide, curr, node, mPrimitives, org, dir, dist, trace))
+			hit = true;
+
+		curr = curr + 1;
+	}
+
+	return hit;
+}
+
+#endif // !STACKLESS_BOUNDING_VOLUME_HIERARCHY_H
@@ -0,0 +1,253 @@
+#include "triblock.h"
+
+#include <cmath>
+#include <limits>
+
+#include "parallel.h"
+#include "simd.h"
+
+// Same threshold as the triangle test of collider.cpp
+static constexpr float kDetEpsilon = std::numeric_limits<float>::epsilon();
+
+// Chunk size of the parallel loop over nodes
+static constexpr int kBlockGrain = 1024;
+
+template <int W>
+void TriangleBlocks<W>::Build(const Bvh& bvh, const PrimitiveTriangle& triangle)
+{
+	const std::vector<BvhNode>& nodes = bvh.GetNodes();
+	const std::vector<Primitive>& primitives = bvh.GetPrimitives();
+	int numNodes = static_cast<int>(nodes.size());
+
+	mNodeBlocks.assign(numNodes + 1, 0);
+	for (int i = 0; i < numNodes; ++i)
+	{
+		int count = IsLeaf(nodes[i]) ? (Length(nodes[i]) + W - 1) / W : 0;
+		mNodeBlocks[i + 1] = mNodeBlocks[i] + count;
+	}
+
+	mBlocks.resize(mNodeBlocks[numNodes]);
+
+	ParallelFor(0, numNodes, kBlockGrain, [&](int b, int e)
+	{
+		for (int n = b; n < e; ++n)
+		{
+			const BvhNode& node = nodes[n];
+			if (!IsLeaf(node)) continue;
+
+			for (int k = 0; k < Length(node); k += W)
+			{
+				TriangleBlock<W>& block = mBlocks[mNodeBlocks[n] + k / W];
+
+				for (int l = 0; l < W; ++l)
+				{
+					vec3 v0(0.f), v1(0.f), v2(0.f);
+					int face = -1;
+
+					if (k + l < Length(node))
+					{
+						const Primitive& primitive = primitives[Offset(node) + k + l];
+						triangle(primitive, v0, v1, v2);
+						face = primitive.idx();
+					}
+
+					vec3 e1 = v1 - v0;
+					vec3 e2 = v2 - v0;
+					for (int a = 0; a < 3; ++a)
+					{
+						block.v0[a][l] = v0[a];
+						block.e1[a][l] = e1[a];
+						block.e2[a][l] = e2[a];
+					}
+					block.face[l] = face;
+				}
+			}
+		}
+	});
+}
+
+// SIMD lanes of IntersectLanes
+#if defined(SIMD_SSE)
+struct LanesSse
+{
+	using V = __m128;
+	static constexpr int kWidth = 4;
+
+	static V Load(const float* p) { return _mm_loadu_ps(p); }
+	static V Set(float x) { return _mm_set1_ps(x); }
+	static void Store(float* p, V a) { _mm_storeu_ps(p, a); }
+	static V Add(V a, V b) { return _mm_add_ps(a, b); }
+	static V Sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static V Mul(V a, V b) { return _mm_mul_ps(a, b); }
+	static V Div(V a, V b) { return _mm_div_ps(a, b); }
+	static V Abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+	static V And(V a, V b) { return _mm_and_ps(a, b); }
+	static V Ge(V a, V b) { return _mm_cmpge_ps(a, b); }
+	static V Gt(V a, V b) { return _mm_cmpgt_ps(a, b); }
+	static V Le(V a, V b) { return _mm_cmple_ps(a, b); }
+	static V Lt(V a, V b) { return _mm_cmplt_ps(a, b); }
+	static int Mask(V a) { return _mm_movemask_ps(a); }
+};
+#endif
+
+#if defined(SIMD_AVX)
+struct LanesAvx
+{
+	using V = __m256;
+	static constexpr int kWidth = 8;
+
+	static V Load(const float* p) { return _mm256_loadu_ps(p); }
+	static V Set(float x) { return _mm256_set1_ps(x); }
+	static void Store(float* p, V a) { _mm256_storeu_ps(p, a); }
+	static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+	static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static V Div(V a, V b) { return _mm256_div_ps(a, b); }
+	static V Abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+	static V And(V a, V b) { return _mm256_and_ps(a, b); }
+	static V Ge(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	static V Gt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static V Le(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static V Lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static int Mask(V a) { return _mm256_movemask_ps(a); }
+};
+#endif
+
+// Moller-Trumbore test of lanes [i, i + L::kWidth) of a block, in the same
+// order of operations as collider.cpp. Stores t, u, v of every lane and
+// returns the bit mask of lanes hit within (tmin, dist).
+template <class L, int W>
+static inline int IntersectLanes(
+	const TriangleBlock<W>& block,
+	int i,
+	const vec3& org,
+	const vec3& dir,
+	float tmin,
+	float dist,
+	float* t,
+	float* u,
+	float* v)
+{
+	using V = typename L::V;
+
+	V dx = L::Set(dir.x), dy = L::Set(dir.y), dz = L::Set(dir.z);
+	V e1x = L::Load(block.e1[0] + i), e1y = L::Load(block.e1[1] + i), e1z = L::Load(block.e1[2] + i);
+	V e2x = L::Load(block.e2[0] + i), e2y = L::Load(block.e2[1] + i), e2z = L::Load(block.e2[2] + i);
+
+	// pvc = cross(dir, e2), det = dot(e1, pvc)
+	V px = L::Sub(L::Mul(dy, e2z), L::Mul(e2y, dz));
+	V py = L::Sub(L::Mul(dz, e2x), L::Mul(e2z, dx));
+	V pz = L::Sub(L::Mul(dx, e2y), L::Mul(e2x, dy));
+	V det = L::Add(L::Add(L::Mul(e1x, px), L::Mul(e1y, py)), L::Mul(e1z, pz));
+	V inv = L::Div(L::Set(1.f), det);
+
+	// tvc = org - v0, u = dot(tvc, pvc) / det
+	V tx = L::Sub(L::Set(org.x), L::Load(block.v0[0] + i));
+	V ty = L::Sub(L::Set(org.y), L::Load(block.v0[1] + i));
+	V tz = L::Sub(L::Set(org.z), L::Load(block.v0[2] + i));
+	V uu = L::Mul(L::Add(L::Add(L::Mul(tx, px), L::Mul(ty, py)), L::Mul(tz, pz)), inv);
+
+	// qvc = cross(tvc, e1), v = dot(dir, qvc) / det, t = dot(e2, qvc) / det
+	V qx = L::Sub(L::Mul(ty, e1z), L::Mul(e1y, tz));
+	V qy = L::Sub(L::Mul(tz, e1x), L::Mul(e1z, tx));
+	V qz = L::Sub(L::Mul(tx, e1y), L::Mul(e1x, ty));
+	V vv = L::Mul(L::Add(L::Add(L::Mul(dx, qx), L::Mul(dy, qy)), L::Mul(dz, qz)), inv);
+	V tt = L::Mul(L::Add(L::Add(L::Mul(e2x, qx), L::Mul(e2y, qy)), L::Mul(e2z, qz)), inv);
+
+	V one = L::Set(1.f), zero = L::Set(0.f);
+	V hit = L::And(
+		L::And(
+			L::And(L::Ge(L::Abs(det), L::Set(kDetEpsilon)), L::And(L::Ge(uu, zero), L::Le(uu, one))),
+			L::And(L::Ge(vv, zero), L::Le(L::Add(uu, vv), one))),
+		L::And(L::Gt(tt, L::Set(tmin)), L::Lt(tt, L::Set(dist))));
+
+	L::Store(t + i, tt);
+	L::Store(u + i, uu);
+	L::Store(v + i, vv);
+	return L::Mask(hit) << i;
+}
+
+template <int W>
+static inline int IntersectBlock(
+	const TriangleBlock<W>& block,
+	const vec3& org,
+	const vec3& dir,
+	float tmin,
+	float dist,
+	float* t,
+	float* u,
+	float* v)
+{
+	int mask = 0;
+	int i = 0;
+
+#if defined(SIMD_AVX)
+	for (; i + 8 <= W; i += 8)
+		mask |= IntersectLanes<LanesAvx>(block, i, org, dir, tmin, dist, t, u, v);
+#endif
+
+#if defined(SIMD_SSE)
+	for (; i + 4 <= W; i += 4)
+		mask |= IntersectLanes<LanesSse>(block, i, org, dir, tmin, dist, t, u, v);
+#endif
+
+	for (; i < W; ++i)
+	{
+		vec3 v0(block.v0[0][i], block.v0[1][i], block.v0[2][i]);
+		vec3 e1(block.e1[0][i], block.e1[1][i], block.e1[2][i]);
+		vec3 e2(block.e2[0][i], block.e2[1][i], block.e2[2][i]);
+
+		vec3 pvc = cross(dir, e2);
+		float det = dot(e1, pvc);
+		if (std::fabs(det) < kDetEpsilon) continue;
+
+		float inv = 1 / det;
+		vec3 tvc = org - v0;
+		u[i] = dot(tvc, pvc) * inv;
+		if (u[i] < 0.f || u[i] > 1.f) continue;
+
+		vec3 qvc = cross(tvc, e1);
+		v[i] = dot(dir, qvc) * inv;
+		if (v[i] < 0.f || u[i] + v[i] > 1.f) continue;
+
+		t[i] = dot(e2, qvc) * inv;
+		if (t[i] > tmin && t[i] < dist)
+			mask |= 1 << i;
+	}
+
+	return mask;
+}
+
+template <int W>
+bool TriangleBlocks<W>::Intersect(
+	int nodeId,
+	const vec3& org,
+	const vec3& dir,
+	float tmin,
+	float& dist,
+	RayHit& hit) const
+{
+	bool found = false;
+
+	for (int b = mNodeBlocks[nodeId]; b < mNodeBlocks[nodeId + 1]; ++b)
+	{
+		const TriangleBlock<W>& block = mBlocks[b];
+		float t[W], u[W], v[W];
+		int mask = IntersectBlock(block, org, dir, tmin, dist, t, u, v);
+
+		// Closest lane, the first one on ties like sequential tests
+		for (int l = 0; mask; ++l, mask >>= 1)
+		{
+			if (!(mask & 1) || !(t[l] < dist)) continue;
+
+			dist = t[l];
+			hit = { block.face[l], t[l], u[l], v[l] };
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+template class TriangleBlocks<4>;
+template class TriangleBlocks<8>;
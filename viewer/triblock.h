@@ -0,0 +1,74 @@
+#pragma once
+#ifndef TRIANGLE_BLOCK_H
+#define TRIANGLE_BLOCK_H
+
+#include "bvh.h"
+
+// W triangles of a leaf as structure of arrays with precomputed edges
+// e1 = v1 - v0 and e2 = v2 - v0. face = -1 pads the last block of a leaf.
+template <int W>
+struct alignas(32) TriangleBlock
+{
+	float v0[3][W];
+	float e1[3][W];
+	float e2[3][W];
+	int face[W];
+};
+
+// Triangles of a built Bvh packed leaf by leaf in Bvh order, so that a
+// ray is tested against W triangles at once without touching the mesh.
+// Must be rebuilt when the tree or the mesh changes.
+template <int W>
+class TriangleBlocks
+{
+public:
+	void Build(const Bvh& bvh, const PrimitiveTriangle& triangle);
+
+	// Closest hit among the triangles of leaf nodeId within (tmin, dist),
+	// same test as IsIntersecting(...) of collider.h without culling
+	bool Intersect(
+		int nodeId,
+		const vec3& org,
+		const vec3& dir,
+		float tmin,
+		float& dist,
+		RayHit& hit) const;
+
+	const std::vector<TriangleBlock<W>>& GetBlocks() const { return mBlocks; }
+
+protected:
+	std::vector<TriangleBlock<W>> mBlocks;
+	std::vector<int> mNodeBlocks; // blocks of each node, CSR offsets; none for inner nodes
+};
+
+// Closest-hit callback testing whole leaves with TriangleBlocks. Like
+// PrimitiveHit it is a per-query context.
+template <int W>
+struct BlockCollide
+{
+	BlockCollide(const TriangleBlocks<W>& blocks, float tmin) : blocks(blocks), tmin(tmin) {}
+
+	const TriangleBlocks<W>& blocks;
+	float tmin;
+	mutable RayHit hit;
+};
+
+template <int W, class Trace>
+inline bool CollideLeaf(
+	const BlockCollide<W>& collide,
+	int nodeId,
+	const BvhNode&,
+	const std::vector<Primitive>&,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	Trace& trace)
+{
+	trace.TestPrimitive();
+	return collide.blocks.Intersect(nodeId, org, dir, collide.tmin, dist, collide.hit);
+}
+
+using TriangleBlocks4 = TriangleBlocks<4>;
+using TriangleBlocks8 = TriangleBlocks<8>;
+
+#endif // !TRIANGLE_BLOCK_H
@@ -0,0 +1,51 @@
+#include "tribuffer.h"
+
+#include "parallel.h"
+
+// Chunk size of the parallel loops over faces or vertices
+static constexpr int kGatherGrain = 4096;
+
+void TriangleBuffer::Build(const TheMesh& mesh)
+{
+	int numFaces = static_cast<int>(mesh.n_faces());
+	mIndices.resize(3 * numFaces);
+
+	ParallelFor(0, numFaces, kGatherGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			OpenMesh::HalfedgeHandle hH = mesh.halfedge_handle(OpenMesh::FaceHandle(i));
+			for (int k = 0; k < 3; ++k)
+			{
+				mIndices[3 * i + k] = mesh.to_vertex_handle(hH).idx();
+				hH = mesh.next_halfedge_handle(hH);
+			}
+		}
+	});
+
+	UpdatePoints(mesh);
+}
+
+void TriangleBuffer::UpdatePoints(const TheMesh& mesh)
+{
+	int numVertices = static_cast<int>(mesh.n_vertices());
+	mPoints.resize(numVertices);
+
+	ParallelFor(0, numVertices, kGatherGrain, [&](int b, int e)
+	{
+		for (int i = b; i < e; ++i)
+		{
+			const TheMesh::Point& p = mesh.point(OpenMesh::VertexHandle(i));
+			mPoints[i] = { p[0], p[1], p[2] };
+		}
+	});
+}
+
+void TriangleBuffer::UpdatePoints(const TheMesh& mesh, const std::vector<OpenMesh::VertexHandle>& moved)
+{
+	for (OpenMesh::VertexHandle hV : moved)
+	{
+		const TheMesh::Point& p = mesh.point(hV);
+		mPoints[hV.idx()] = { p[0], p[1], p[2] };
+	}
+}
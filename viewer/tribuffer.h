@@ -0,0 +1,44 @@
+#pragma once
+#ifndef TRIANGLE_BUFFER_H
+#define TRIANGLE_BUFFER_H
+
+#include "aabb.h"
+#include "Mesh.h"
+
+// Vertex positions and corner indices of a triangle mesh gathered once into
+// flat arrays, so that building and querying Bvh never walk the halfedge
+// structure. Face i and vertex i of the buffer are face i and vertex i of
+// the mesh, corners in the order of the face's halfedge loop.
+// Build again when the connectivity changes, UpdatePoints when vertices move.
+class TriangleBuffer
+{
+public:
+	TriangleBuffer() {}
+
+	explicit TriangleBuffer(const TheMesh& mesh) { Build(mesh); }
+
+	void Build(const TheMesh& mesh);
+
+	// Copy positions of all vertices, or only of the moved ones
+	void UpdatePoints(const TheMesh& mesh);
+	void UpdatePoints(const TheMesh& mesh, const std::vector<OpenMesh::VertexHandle>& moved);
+
+	void GetTriangle(int face, vec3& v0, vec3& v1, vec3& v2) const
+	{
+		const int* corners = &mIndices[3 * face];
+		v0 = mPoints[corners[0]];
+		v1 = mPoints[corners[1]];
+		v2 = mPoints[corners[2]];
+	}
+
+	int GetNumFaces() const { return static_cast<int>(mIndices.size() / 3); }
+
+	const std::vector<vec3>& GetPoints() const { return mPoints; }
+	const std::vector<int>& GetIndices() const { return mIndices; }
+
+protected:
+	std::vector<vec3> mPoints;
+	std::vector<int> mIndices; // 3 vertices per face
+};
+
+#endif // !TRIANGLE_BUFFER_H
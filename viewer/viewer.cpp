@@ -21,6 +21,8 @@
 
 #include "collider.h"
 #include "bvh.h"
+#include "bench.h"
+#include "tribuffer.h"
 
 using namespace OpenMesh;
 using M = TheMesh;
@@ -33,6 +35,10 @@ static int g_startx, g_starty;
 static int g_pick_x, g_pick_y;
 static int g_shade_flag = 0;
 
+// rectangle selection, window coordinates of the fixed and moving corner
+static bool g_marquee = false;
+static int g_marquee_x0, g_marquee_y0, g_marquee_x1, g_marquee_y1;
+
 // rotation quaternion and translation vector for the object
 static glm::quat g_obj_rot(1, 0, 0, 0);
 static glm::vec3 g_obj_trans(0, 0, 0);
@@ -43,9 +49,12 @@ static ArcBall g_arcball;
 // mesh
 static TheMesh g_mesh;
 
+// mesh triangles for Bvh building and queries
+static TriangleBuffer g_triangles;
+
 // method
 static TheMethod g_method(&g_mesh);
-static Collider g_rc(&g_mesh);
+static Collider g_rc(&g_triangles);
 
 // Bvh
 static Bvh g_bvh;
@@ -53,6 +62,9 @@ static Bvh g_bvh;
 // Bvh debug
 static std::vector<Aabb> g_bboxes;
 
+// faces intersecting another face of the mesh, found by find_self_intersections
+static FPropHandleT<bool> g_self_hit;
+
 inline double When()
 {
 #ifdef _WIN32
@@ -70,6 +82,9 @@ void print_usage_message()
     printf("w  -  Wireframe Display\n");
     printf("f  -  Flat Shading \n");
     printf("s  -  Smooth Shading\n");
+    printf("l  -  Laplacian Smoothing (selected vertices or all)\n");
+    printf("i  -  Self-intersecting Faces\n");
+    printf("shift + drag - Rectangle Selection of faces\n");
     printf("?  -  Help Information\n");
     printf("esc - Quit\n");
 }
@@ -266,8 +281,6 @@ void draw_selected_edges()
 
 void draw_selected_faces()
 {
-    PrimitiveBound bound(g_mesh);
-
     glEnable(GL_LIGHTING);
     for (M::FaceIter fiter = g_mesh.faces_begin(); fiter != g_mesh.faces_end(); ++fiter)
     {
@@ -304,6 +317,27 @@ void draw_selected_faces()
     }
 }
 
+void draw_self_intersections()
+{
+    glDisable(GL_LIGHTING);
+    glColor3f(1, 0, 0);
+    for (FaceHandle hF : g_mesh.faces())
+    {
+        if (!g_mesh.property(g_self_hit, hF))
+            continue;
+
+        Point n = g_mesh.normal(hF);
+        glBegin(GL_POLYGON);
+        for (M::FaceVertexIter fviter = g_mesh.fv_iter(hF); fviter != g_mesh.fv_end(hF); ++fviter)
+        {
+            Point p = g_mesh.point(*fviter) + n * 0.001f;
+            glVertex3d(p[0], p[1], p[2]);
+        }
+        glEnd();
+    }
+    glEnable(GL_LIGHTING);
+}
+
 void draw_bvh(const Bvh& bvh)
 {
     //for (const NodePtr& node : bvh.GetNodes())
@@ -314,12 +348,9 @@ void draw_bvh(const Bvh& bvh)
             draw_aabb(node.bbox, { 1,1,1 });
 }
 
-void draw_aabb(const Aabb& bbox)
-{
-    g_bboxes.push_back(bbox);
-}
-
-void pick_attribute(int x, int y)
+// ray through window point (x, y) in object coordinates, from the near to
+// the far plane
+void get_pick_ray(int x, int y, vec3& ro, vec3& rd)
 {
     double modelViewMatrix[16];
     double projectionMatrix[16];
@@ -347,11 +378,17 @@ void pick_attribute(int x, int y)
         viewport, &farPlaneLocation[0], &farPlaneLocation[1],
         &farPlaneLocation[2]);
 
-    vec3 ro(nearPlaneLocation[0], nearPlaneLocation[1], nearPlaneLocation[2]);
+    ro = vec3(nearPlaneLocation[0], nearPlaneLocation[1], nearPlaneLocation[2]);
 
-    vec3 rd(farPlaneLocation[0] - nearPlaneLocation[0],
+    rd = vec3(farPlaneLocation[0] - nearPlaneLocation[0],
         farPlaneLocation[1] - nearPlaneLocation[1],
         farPlaneLocation[2] - nearPlaneLocation[2]);
+}
+
+void pick_attribute(int x, int y)
+{
+    vec3 ro, rd;
+    get_pick_ray(x, y, ro, rd);
 
     // Bvh debug only
     g_bboxes.clear();
@@ -361,8 +398,10 @@ void pick_attribute(int x, int y)
     //double dt = When();
     auto start = std::chrono::steady_clock::now();
 
+    BvhTraceRecord trace(g_bboxes);
+
     if (UIOption::accel_mode)
-        hFs = g_rc.collide(g_bvh, ro, rd, dist);
+        hFs = g_rc.collide(g_bvh, ro, rd, dist, trace);
     else
         hFs = g_rc.collide(ro, rd, dist);
 
@@ -371,6 +410,13 @@ void pick_attribute(int x, int y)
     auto end = std::chrono::steady_clock::now();
     printf("Elapsed time = %zd us\n", std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
 
+    if (UIOption::accel_mode)
+    {
+        printf("Number of AABB intersecting test = %d\n", trace.numNodes);
+        printf("Number of Primitive intersecting test = %d\n", trace.numPrimitives);
+        printf("Intersecting test result = %d\n", hFs.is_valid());
+    }
+
     if (hFs.is_valid())
     {
         Point hit = g2o(ro + rd * dist);
@@ -442,6 +488,208 @@ void pick_attribute(int x, int y)
     }
 }
 
+// select faces within the brush radius of the surface point under (x, y)
+void brush_select(int x, int y)
+{
+    vec3 ro, rd;
+    get_pick_ray(x, y, ro, rd);
+
+    float dist = 1e10f;
+    FaceHandle hF = g_rc.collide(g_bvh, ro, rd, dist);
+    if (!hF.is_valid()) return;
+
+    PrimitiveTriangle triangle(g_triangles);
+    g_bvh.QuerySphere(triangle, ro + rd * dist, UIOption::brush_radius,
+        [](const Primitive& face) { g_mesh.status(face).set_selected(true); });
+}
+
+// eye position in object coordinates
+vec3 get_eye()
+{
+    double modelViewMatrix[16];
+
+    setup_camera();
+    glPushMatrix();
+    transform_world2object();
+    glGetDoublev(GL_MODELVIEW_MATRIX, modelViewMatrix);
+    glPopMatrix();
+
+    glm::dmat4 inv = glm::inverse(glm::make_mat4(modelViewMatrix));
+    return vec3(inv[3]);
+}
+
+// select faces inside the window rectangle (x0, y0) - (x1, y1), only the
+// ones seen from the eye if UIOption::visible_only
+void marquee_select(int x0, int y0, int x1, int y1)
+{
+    if (x0 == x1 || y0 == y1) return;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // corners of the rectangle on the near and far planes
+    int xs[4] = { x0, x1, x1, x0 };
+    int ys[4] = { y0, y0, y1, y1 };
+    vec3 nearCorners[4], farCorners[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        vec3 ro, rd;
+        get_pick_ray(xs[i], ys[i], ro, rd);
+        nearCorners[i] = ro;
+        farCorners[i] = ro + rd;
+    }
+
+    std::vector<Primitive> faces;
+    PrimitiveTriangle triangle(g_triangles);
+    g_bvh.QueryFrustum(triangle, GetFrustum(nearCorners, farCorners), faces);
+    size_t numInside = faces.size();
+
+    if (UIOption::visible_only)
+    {
+        // back faces are culled; segments from the eye to the centroids
+        // of the front faces stop short of the face itself
+        vec3 eye = get_eye();
+        std::vector<Primitive> front;
+        std::vector<Ray> rays;
+        for (const Primitive& hF : faces)
+        {
+            vec3 v0, v1, v2;
+            triangle(hF, v0, v1, v2);
+            vec3 centroid = (v0 + v1 + v2) / 3.f;
+            if (dot(cross(v1 - v0, v2 - v0), eye - centroid) <= 0.f) continue;
+
+            Ray ray;
+            ray.org = eye;
+            ray.dir = centroid - eye;
+            ray.tmax = 1.f - 1e-4f;
+            front.push_back(hF);
+            rays.push_back(ray);
+        }
+
+        std::vector<char> occluded;
+        PrimitiveOcclude occlude(triangle);
+        g_bvh.Occluded(occlude, rays, occluded);
+
+        faces.clear();
+        for (size_t i = 0; i < front.size(); ++i)
+            if (!occluded[i])
+                faces.push_back(front[i]);
+    }
+
+    for (const Primitive& hF : faces)
+        g_mesh.status(hF).set_selected(true);
+
+    auto end = std::chrono::steady_clock::now();
+    printf("Rectangle selection: %zd faces inside, %zd selected, elapsed time = %zd us\n",
+        numInside, faces.size(),
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+}
+
+// draw the selection rectangle over the scene
+void draw_marquee()
+{
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluOrtho2D(0, g_win_width, g_win_height, 0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glLineWidth(1.0);
+    glColor3f(1, 1, 0);
+    glBegin(GL_LINE_LOOP);
+    glVertex2i(g_marquee_x0, g_marquee_y0);
+    glVertex2i(g_marquee_x1, g_marquee_y0);
+    glVertex2i(g_marquee_x1, g_marquee_y1);
+    glVertex2i(g_marquee_x0, g_marquee_y1);
+    glEnd();
+    glEnable(GL_DEPTH_TEST);
+
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+// one step of Laplacian smoothing then refit Bvh to the moved faces
+void smooth_mesh()
+{
+    std::vector<VertexHandle> verts;
+    for (VertexHandle hV : g_mesh.vertices())
+        if (g_mesh.status(hV).selected())
+            verts.push_back(hV);
+
+    bool partial = !verts.empty();
+    if (!partial)
+        for (VertexHandle hV : g_mesh.vertices())
+            verts.push_back(hV);
+
+    std::vector<Point> points(verts.size());
+    for (size_t i = 0; i < verts.size(); ++i)
+    {
+        Point c(0, 0, 0);
+        int n = 0;
+        for (M::VertexVertexIter vviter = g_mesh.vv_iter(verts[i]); vviter.is_valid(); ++vviter, ++n)
+            c += g_mesh.point(*vviter);
+        Point p = g_mesh.point(verts[i]);
+        points[i] = n ? p + (c / n - p) * 0.5f : p;
+    }
+
+    for (size_t i = 0; i < verts.size(); ++i)
+        g_mesh.set_point(verts[i], points[i]);
+    g_mesh.update_normals();
+
+    auto start = std::chrono::steady_clock::now();
+    PrimitiveBound bound(g_triangles);
+
+    if (partial)
+    {
+        g_triangles.UpdatePoints(g_mesh, verts);
+
+        std::vector<Primitive> moved;
+        for (VertexHandle hV : verts)
+            for (M::VertexFaceIter vfiter = g_mesh.vf_iter(hV); vfiter.is_valid(); ++vfiter)
+                moved.push_back(*vfiter);
+        g_bvh.Refit(bound, moved);
+    }
+    else
+    {
+        g_triangles.UpdatePoints(g_mesh);
+        g_bvh.Refit(bound);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    printf("Refit %s: elapsed time = %zd us\n", partial ? "partial" : "full",
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+}
+
+// mark the faces that intersect another face of the mesh
+void find_self_intersections()
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<FacePair> pairs;
+    g_bvh.SelfCollidePairs(PrimitiveTriangle(g_triangles), pairs);
+
+    for (FaceHandle hF : g_mesh.faces())
+        g_mesh.property(g_self_hit, hF) = false;
+
+    for (const FacePair& pair : pairs)
+    {
+        g_mesh.property(g_self_hit, FaceHandle(pair.face0)) = true;
+        g_mesh.property(g_self_hit, FaceHandle(pair.face1)) = true;
+    }
+
+    size_t numFaces = 0;
+    for (FaceHandle hF : g_mesh.faces())
+        numFaces += g_mesh.property(g_self_hit, hF);
+
+    auto end = std::chrono::steady_clock::now();
+    printf("Self-intersections: %zd pairs, %zd faces, elapsed time = %zd ms\n", pairs.size(), numFaces,
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+}
+
 // display call back function
 void display()
 {
@@ -462,6 +710,7 @@ void display()
     draw_selected_vertices();
     draw_selected_edges();
     draw_selected_faces();
+    draw_self_intersections();
 
     // draw mesh
     draw_mesh();
@@ -472,6 +721,9 @@ void display()
         for (const Aabb& bbox : g_bboxes)
             draw_aabb(bbox, { 1,1,1 }, 2);
 
+    if (g_marquee)
+        draw_marquee();
+
     // ui
     UI::render();
 
@@ -526,6 +778,12 @@ void keyBoard(unsigned char key, int x, int y)
         // Wireframe mode
         glPolygonMode(GL_FRONT, GL_LINE);
         break;
+    case 'l':
+        smooth_mesh();
+        break;
+    case 'i':
+        find_self_intersections();
+        break;
     case '?':
         print_usage_message();
         break;
@@ -539,13 +797,34 @@ void keyBoard(unsigned char key, int x, int y)
     glutPostRedisplay();
 }
 
+// left button paints faces with the sphere brush instead of rotating
+bool is_brushing()
+{
+    return UIOption::brush_mode && UIOption::select_mode == UIOption::SELECT_FACE;
+}
+
 // mouse click call back function
 void mouseClick(int button, int state, int x, int y)
 {
     /* set up an arcball around the Eye's center
     switch y coordinates to right handed system  */
 
-    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN &&
+        UIOption::select_mode == UIOption::SELECT_FACE && (glutGetModifiers() & GLUT_ACTIVE_SHIFT))
+    {
+        g_button = GLUT_LEFT_BUTTON;
+        g_pick_x = -1;
+        g_marquee = true;
+        g_marquee_x0 = g_marquee_x1 = x;
+        g_marquee_y0 = g_marquee_y1 = y;
+    }
+    else if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN && is_brushing())
+    {
+        g_button = GLUT_LEFT_BUTTON;
+        g_pick_x = -1;
+        brush_select(x, g_win_height - y);
+    }
+    else if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
     {
         g_button = GLUT_LEFT_BUTTON;
         g_pick_x = x;
@@ -570,6 +849,12 @@ void mouseClick(int button, int state, int x, int y)
         g_button = GLUT_RIGHT_BUTTON;
     }
     
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_UP && g_marquee)
+    {
+        g_marquee = false;
+        marquee_select(g_marquee_x0, g_win_height - g_marquee_y0, x, g_win_height - y);
+    }
+
     if (button == GLUT_LEFT_BUTTON && state == GLUT_UP)
     {
         if (g_pick_x == x && g_pick_y == y)
@@ -589,8 +874,23 @@ void mouseMove(int x, int y)
     glm::vec3 trans;
     glm::quat rot;
     
+    // rectangle selection
+    if (g_button == GLUT_LEFT_BUTTON && g_marquee)
+    {
+        g_marquee_x1 = x;
+        g_marquee_y1 = y;
+        glutPostRedisplay();
+    }
+
+    // brush selection
+    else if (g_button == GLUT_LEFT_BUTTON && is_brushing())
+    {
+        brush_select(x, g_win_height - y);
+        glutPostRedisplay();
+    }
+
     // rotation, call g_arcball
-    if (g_button == GLUT_LEFT_BUTTON)
+    else if (g_button == GLUT_LEFT_BUTTON)
     {
         rot = g_arcball.update_quat(x - g_win_width / 2, g_win_height / 2 - y);
         g_obj_rot = rot * g_obj_rot;
@@ -683,26 +983,48 @@ void initOpenGL(int argc, char* argv[])
     setupGLstate();
 }
 
+int get_split_method(const char* method)
+{
+    if (strcmp(method, "middle") == 0)
+        return PrimitiveSplit::SPLIT_MIDDLE;
+    if (strcmp(method, "sah") == 0)
+        return PrimitiveSplit::SPLIT_SAH;
+    return PrimitiveSplit::SPLIT_EQUAL_COUNTS;
+}
+
 // build Bvh of mesh
-void initBvh(Bvh& bvh, TheMesh& mesh)
+float initBvh(Bvh& bvh, const TriangleBuffer& triangles, const char* method)
 {
-    PrimitiveBound bound(mesh);
-    PrimitiveSplit split(bound);
+    PrimitiveBound bound(triangles);
+    PrimitiveSplit split(get_split_method(method));
     std::vector<Primitive> primitives;
 
-    for (auto& fh : mesh.faces())
+    for (int i = 0; i < triangles.GetNumFaces(); ++i)
     {
-        primitives.push_back(fh);
+        primitives.push_back(Primitive(i));
     }
 
-    bvh.Build(primitives, bound, split, 1);
+    if (strcmp(method, "lbvh") == 0)
+        return bvh.BuildLinear(primitives, bound, 30);
+    if (strcmp(method, "lbvh63") == 0)
+        return bvh.BuildLinear(primitives, bound, 63);
+    if (strcmp(method, "ploc") == 0)
+        return bvh.BuildPloc(primitives, bound, 16, 30);
+    if (strcmp(method, "sbvh") == 0)
+    {
+        PrimitiveTriangle triangle(triangles);
+        split.method = PrimitiveSplit::SPLIT_SAH;
+        return bvh.BuildSpatial(primitives, bound, triangle, split, 0.3f, 1);
+    }
+
+    return bvh.Build(primitives, bound, split, 1);
 }
 
 int main(int argc, char* argv[])
 {
     if (argc < 2)
     {
-        fprintf(stderr, "Usage: %s [mesh name]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [mesh name] [middle|equal|sah|lbvh|lbvh63|ploc|sbvh] [--optimize] [--bench]\n", argv[0]);
         return 1;
     }
 
@@ -713,10 +1035,62 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    const char* method = "equal";
+    bool bench = false;
+    bool optimize = false;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--bench") == 0)
+            bench = true;
+        else if (strcmp(argv[i], "--optimize") == 0)
+            optimize = true;
+        else
+            method = argv[i];
+    }
+
     resize_unit_box(g_mesh);
     g_mesh.update_normals();
 
-    initBvh(g_bvh, g_mesh);
+    if (bench)
+    {
+        bench_build(g_mesh, method);
+        bench_wide(g_mesh, method);
+        bench_occluded(g_mesh, method);
+        bench_rays(g_mesh, method);
+        bench_stream(g_mesh, method);
+        bench_blocks(g_mesh);
+        bench_stackless(g_mesh, method);
+        bench_closest(g_mesh, method);
+        bench_knearest(g_mesh, method);
+        bench_query(g_mesh, method);
+        bench_frustum(g_mesh, method);
+        bench_collide(g_mesh, method);
+        bench_self(g_mesh, method);
+        return 0;
+    }
+
+    g_mesh.add_property(g_self_hit);
+    for (FaceHandle hF : g_mesh.faces())
+        g_mesh.property(g_self_hit, hF) = false;
+
+    g_triangles.Build(g_mesh);
+    float cost = initBvh(g_bvh, g_triangles, method);
+    printf("Bvh method = %s, SAH cost = %f\n", method, cost);
+
+    // spatial splits reference some faces from several leaves
+    int numFaces = static_cast<int>(g_mesh.n_faces());
+    int numRefs = static_cast<int>(g_bvh.GetPrimitives().size());
+    if (numRefs != numFaces)
+        printf("Bvh references = %d (%.1f%% duplicated)\n", numRefs, 100.f * (numRefs - numFaces) / numFaces);
+
+    if (optimize)
+    {
+        auto start = std::chrono::steady_clock::now();
+        float optimized = g_bvh.Optimize(16, 2000.f);
+        auto end = std::chrono::steady_clock::now();
+        printf("Bvh optimized SAH cost = %f -> %f, elapsed time = %zd ms\n", cost, optimized,
+            std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+    }
 
     int numInnrNode = 0, numLeafNode = 0;
     for (const auto& node : g_bvh.GetNodes())
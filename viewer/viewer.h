@@ -3,8 +3,12 @@
 #define VIEWER_H
 
 #include "aabb.h"
+#include "Mesh.h"
 
-// Bvh debug
-void draw_aabb(const Aabb& bbox);
+class Bvh;
+class TriangleBuffer;
+
+// Build Bvh of the triangles by method name, returns SAH cost of the tree
+float initBvh(Bvh& bvh, const TriangleBuffer& triangles, const char* method);
 
 #endif // !VIEWER_H
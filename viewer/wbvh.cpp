@@ -0,0 +1,430 @@
+#include "wbvh.h"
+
+#include <cmath>
+#include <cstring>
+
+#include "simd.h"
+
+// Pending children kept on the fixed traversal stack, more spill into the
+// heap
+static constexpr int kStackSize = 512;
+
+// Ray with precomputed reciprocal direction. near[a] selects the slab plane
+// entered first along axis a (0 = min, 1 = max), which also makes inverted
+// boxes of empty slots miss every ray.
+struct WideRay
+{
+	vec3 org;
+	vec3 invDir;
+	int near[3];
+
+	WideRay(const vec3& o, const vec3& d) : org(o), invDir(1.f / d.x, 1.f / d.y, 1.f / d.z)
+	{
+		for (int a = 0; a < 3; ++a)
+			near[a] = (invDir[a] < 0.f) ? 1 : 0;
+	}
+};
+
+// Slab test of all children of a node, same condition as
+// IsIntersecting(Aabb, ...) of aabb.hpp. Returns bit mask of hit children
+// and their entry distances.
+template <int N>
+static inline int IntersectChildren(const float (&bounds)[2][3][N], const WideRay& ray, float dist, float* tnear)
+{
+	const float* nx = bounds[ray.near[0]][0];
+	const float* ny = bounds[ray.near[1]][1];
+	const float* nz = bounds[ray.near[2]][2];
+	const float* fx = bounds[1 - ray.near[0]][0];
+	const float* fy = bounds[1 - ray.near[1]][1];
+	const float* fz = bounds[1 - ray.near[2]][2];
+	int mask = 0;
+	int i = 0;
+
+#if defined(SIMD_AVX)
+	for (; i + 8 <= N; i += 8)
+	{
+		__m256 ox = _mm256_set1_ps(ray.org.x), ix = _mm256_set1_ps(ray.invDir.x);
+		__m256 oy = _mm256_set1_ps(ray.org.y), iy = _mm256_set1_ps(ray.invDir.y);
+		__m256 oz = _mm256_set1_ps(ray.org.z), iz = _mm256_set1_ps(ray.invDir.z);
+
+		__m256 t0 = _mm256_max_ps(
+			_mm256_max_ps(
+				_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nx + i), ox), ix),
+				_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ny + i), oy), iy)),
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nz + i), oz), iz));
+		__m256 t1 = _mm256_min_ps(
+			_mm256_min_ps(
+				_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(fx + i), ox), ix),
+				_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(fy + i), oy), iy)),
+			_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(fz + i), oz), iz));
+
+		__m256 hit = _mm256_and_ps(
+			_mm256_and_ps(
+				_mm256_cmp_ps(t1, _mm256_setzero_ps(), _CMP_GT_OQ),
+				_mm256_cmp_ps(t1, t0, _CMP_GE_OQ)),
+			_mm256_cmp_ps(t0, _mm256_set1_ps(dist), _CMP_LT_OQ));
+
+		_mm256_storeu_ps(tnear + i, t0);
+		mask |= _mm256_movemask_ps(hit) << i;
+	}
+#endif
+
+#if defined(SIMD_SSE)
+	for (; i + 4 <= N; i += 4)
+	{
+		__m128 ox = _mm_set1_ps(ray.org.x), ix = _mm_set1_ps(ray.invDir.x);
+		__m128 oy = _mm_set1_ps(ray.org.y), iy = _mm_set1_ps(ray.invDir.y);
+		__m128 oz = _mm_set1_ps(ray.org.z), iz = _mm_set1_ps(ray.invDir.z);
+
+		__m128 t0 = _mm_max_ps(
+			_mm_max_ps(
+				_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nx + i), ox), ix),
+				_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ny + i), oy), iy)),
+			_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nz + i), oz), iz));
+		__m128 t1 = _mm_min_ps(
+			_mm_min_ps(
+				_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(fx + i), ox), ix),
+				_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(fy + i), oy), iy)),
+			_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(fz + i), oz), iz));
+
+		__m128 hit = _mm_and_ps(
+			_mm_and_ps(
+				_mm_cmpgt_ps(t1, _mm_setzero_ps()),
+				_mm_cmpge_ps(t1, t0)),
+			_mm_cmplt_ps(t0, _mm_set1_ps(dist)));
+
+		_mm_storeu_ps(tnear + i, t0);
+		mask |= _mm_movemask_ps(hit) << i;
+	}
+#endif
+
+	for (; i < N; ++i)
+	{
+		float t0 = std::max(std::max(
+			(nx[i] - ray.org.x) * ray.invDir.x,
+			(ny[i] - ray.org.y) * ray.invDir.y),
+			(nz[i] - ray.org.z) * ray.invDir.z);
+		float t1 = std::min(std::min(
+			(fx[i] - ray.org.x) * ray.invDir.x,
+			(fy[i] - ray.org.y) * ray.invDir.y),
+			(fz[i] - ray.org.z) * ray.invDir.z);
+
+		tnear[i] = t0;
+		if (t1 > 0 && t1 >= t0 && dist > t0)
+			mask |= 1 << i;
+	}
+
+	return mask;
+}
+
+template <int N>
+void WideBvh<N>::Build(const Bvh& bvh)
+{
+	mPrimitives = bvh.GetPrimitives();
+	mNodes.clear();
+
+	if (bvh.GetNodes().empty()) return;
+
+	mNodes.emplace_back();
+	CollapseRecursive(bvh, 0, 0);
+}
+
+template <int N>
+void WideBvh<N>::CollapseRecursive(const Bvh& bvh, int binaryId, int wideId)
+{
+	const std::vector<BvhNode>& nodes = bvh.GetNodes();
+	const BvhNode& root = nodes[binaryId];
+
+	// Open the largest inner child until all N slots are used
+	std::vector<int> slots;
+	if (IsLeaf(root))
+	{
+		slots.push_back(binaryId);
+	}
+	else
+	{
+		slots.push_back(Left(root));
+		slots.push_back(Right(root));
+	}
+
+	while (static_cast<int>(slots.size()) < N)
+	{
+		int best = -1;
+		float bestArea = -1.f;
+
+		for (int i = 0; i < static_cast<int>(slots.size()); ++i)
+		{
+			const BvhNode& node = nodes[slots[i]];
+			if (!IsLeaf(node) && GetArea(node.bbox) > bestArea)
+			{
+				bestArea = GetArea(node.bbox);
+				best = i;
+			}
+		}
+
+		if (best < 0) break;
+
+		const BvhNode& node = nodes[slots[best]];
+		slots[best] = Left(node);
+		slots.push_back(Right(node));
+	}
+
+	for (int i = 0; i < N; ++i)
+	{
+		Aabb bbox = Invalidate();
+		int child = -1;
+		int count = -1;
+
+		if (i < static_cast<int>(slots.size()))
+		{
+			const BvhNode& node = nodes[slots[i]];
+			bbox = node.bbox;
+
+			if (IsLeaf(node))
+			{
+				child = Offset(node);
+				count = Length(node);
+			}
+			else
+			{
+				child = static_cast<int>(mNodes.size());
+				count = 0;
+				mNodes.emplace_back();
+			}
+		}
+
+		WideBvhNode<N>& wide = mNodes[wideId];
+		for (int a = 0; a < 3; ++a)
+		{
+			wide.bounds[0][a][i] = bbox.pMin[a];
+			wide.bounds[1][a][i] = bbox.pMax[a];
+		}
+		wide.child[i] = child;
+		wide.count[i] = count;
+	}
+
+	for (int i = 0; i < static_cast<int>(slots.size()); ++i)
+		if (mNodes[wideId].count[i] == 0)
+			CollapseRecursive(bvh, slots[i], mNodes[wideId].child[i]);
+}
+
+// Children boxes of a node in full precision
+template <int N>
+static inline const float (&GetBounds(const WideBvhNode<N>& node, float (&)[2][3][N]))[2][3][N]
+{
+	return node.bounds;
+}
+
+// Power of two of a quantization grid, built from the exponent bits
+static inline float GetScale(int exponent)
+{
+	uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return scale;
+}
+
+// q * scale is exact for 8-bit q, so the build and every traversal
+// reconstruct identical boxes with or without fused multiply-add
+static inline float Dequantize(float origin, float scale, uint8_t q)
+{
+	return origin + static_cast<float>(q) * scale;
+}
+
+template <int N>
+static inline const float (&GetBounds(const QuantizedBvhNode<N>& node, float (&bounds)[2][3][N]))[2][3][N]
+{
+	for (int a = 0; a < 3; ++a)
+	{
+		float scale = GetScale(node.exponent[a]);
+		for (int i = 0; i < N; ++i)
+		{
+			bounds[0][a][i] = Dequantize(node.origin[a], scale, node.qbounds[0][a][i]);
+			bounds[1][a][i] = Dequantize(node.origin[a], scale, node.qbounds[1][a][i]);
+		}
+	}
+	return bounds;
+}
+
+// Closest hit traversal shared by full precision and quantized nodes
+template <int N, class Node>
+static bool IntersectWide(
+	const std::vector<Node>& nodes,
+	const std::vector<Primitive>& primitives,
+	const PrimitiveCollide& collide,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	int* numVisits)
+{
+	struct Entry
+	{
+		int child;
+		int count;
+		float t;
+	};
+
+	if (nodes.empty()) return false;
+
+	WideRay ray(org, dir);
+	Entry stack[kStackSize];
+	std::vector<Entry> overflow;
+	int top = 0;
+	int visits = 0;
+	bool hit = false;
+
+	stack[top++] = { 0, 0, -FLT_MAX };
+
+	while (top > 0 || !overflow.empty())
+	{
+		Entry entry;
+		if (!overflow.empty())
+		{
+			entry = overflow.back();
+			overflow.pop_back();
+		}
+		else entry = stack[--top];
+
+		// Entered beyond the closest hit found since it was pushed
+		if (entry.t >= dist) continue;
+
+		if (entry.count > 0)
+		{
+			for (int i = entry.child; i < entry.child + entry.count; ++i)
+				if (collide(primitives[i], org, dir, dist))
+					hit = true;
+			continue;
+		}
+
+		const Node& node = nodes[entry.child];
+		float scratch[2][3][N];
+		float tnear[N];
+		int mask = IntersectChildren(GetBounds(node, scratch), ray, dist, tnear);
+		++visits;
+
+		// Push hit children far to near so that the nearest pops first
+		Entry hits[N];
+		int numHits = 0;
+
+		for (int i = 0; i < N; ++i)
+		{
+			if (!(mask & (1 << i)) || node.count[i] < 0) continue;
+
+			Entry e = { node.child[i], node.count[i], tnear[i] };
+			int j = numHits++;
+			for (; j > 0 && hits[j - 1].t < e.t; --j)
+				hits[j] = hits[j - 1];
+			hits[j] = e;
+		}
+
+		for (int i = 0; i < numHits; ++i)
+		{
+			if (top < kStackSize) stack[top++] = hits[i];
+			else overflow.push_back(hits[i]);
+		}
+	}
+
+	if (numVisits) *numVisits += visits;
+
+	return hit;
+}
+
+template <int N>
+bool WideBvh<N>::Intersect(
+	const PrimitiveCollide& collide,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	int* numVisits) const
+{
+	return IntersectWide<N>(mNodes, mPrimitives, collide, org, dir, dist, numVisits);
+}
+
+template <int N>
+void QuantizedBvh<N>::Build(const WideBvh<N>& bvh)
+{
+	const std::vector<WideBvhNode<N>>& nodes = bvh.GetNodes();
+
+	mPrimitives = bvh.GetPrimitives();
+	mNodes.resize(nodes.size());
+
+	for (size_t n = 0; n < nodes.size(); ++n)
+	{
+		const WideBvhNode<N>& node = nodes[n];
+		QuantizedBvhNode<N>& qnode = mNodes[n];
+
+		for (int a = 0; a < 3; ++a)
+		{
+			float lo = FLT_MAX, hi = -FLT_MAX;
+			for (int i = 0; i < N; ++i)
+			{
+				if (node.count[i] < 0) continue;
+				lo = std::min(lo, node.bounds[0][a][i]);
+				hi = std::max(hi, node.bounds[1][a][i]);
+			}
+			if (lo > hi) lo = hi = 0.f;
+
+			// Smallest grid of 255 steps covering the node box
+			int exponent = -126;
+			if (hi > lo)
+			{
+				std::frexp((hi - lo) / 255.f, &exponent);
+				exponent = std::max(exponent, -126);
+			}
+			while (exponent < 127 && Dequantize(lo, GetScale(exponent), 255) < hi)
+				++exponent;
+
+			float scale = GetScale(exponent);
+			qnode.origin[a] = lo;
+			qnode.exponent[a] = static_cast<int8_t>(exponent);
+
+			for (int i = 0; i < N; ++i)
+			{
+				if (node.count[i] < 0)
+				{
+					qnode.qbounds[0][a][i] = 255;
+					qnode.qbounds[1][a][i] = 0;
+					continue;
+				}
+
+				// Round outwards, then fix any rounding of the reconstruction
+				float fmin = std::floor((node.bounds[0][a][i] - lo) / scale);
+				float fmax = std::ceil((node.bounds[1][a][i] - lo) / scale);
+				int qmin = static_cast<int>(std::min(std::max(fmin, 0.f), 255.f));
+				int qmax = static_cast<int>(std::min(std::max(fmax, 0.f), 255.f));
+
+				while (qmin > 0 && Dequantize(lo, scale, qmin) > node.bounds[0][a][i])
+					--qmin;
+				while (qmax < 255 && Dequantize(lo, scale, qmax) < node.bounds[1][a][i])
+					++qmax;
+
+				qnode.qbounds[0][a][i] = static_cast<uint8_t>(qmin);
+				qnode.qbounds[1][a][i] = static_cast<uint8_t>(qmax);
+			}
+		}
+
+		for (int i = 0; i < N; ++i)
+		{
+			qnode.child[i] = node.child[i];
+			qnode.count[i] = node.count[i];
+		}
+	}
+}
+
+template <int N>
+bool QuantizedBvh<N>::Intersect(
+	const PrimitiveCollide& collide,
+	const vec3& org,
+	const vec3& dir,
+	float& dist,
+	int* numVisits) const
+{
+	return IntersectWide<N>(mNodes, mPrimitives, collide, org, dir, dist, numVisits);
+}
+
+template class WideBvh<2>;
+template class WideBvh<4>;
+template class WideBvh<8>;
+
+template class QuantizedBvh<4>;
+template class QuantizedBvh<8>;
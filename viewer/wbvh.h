@@ -0,0 +1,96 @@
+#pragma once
+#ifndef WIDE_BOUNDING_VOLUME_HIERARCHY_H
+#define WIDE_BOUNDING_VOLUME_HIERARCHY_H
+
+#include <cstdint>
+
+#include "bvh.h"
+
+// Node of an N-wide Bvh with children boxes stored as structure of arrays,
+// so that one ray is tested against all of them at once.
+// bounds[0] = min corners, bounds[1] = max corners, per axis, per child.
+// For child i:
+// count[i] > 0: leaf, child[i] = beginning index in the primitive array;
+// count[i] = 0: inner node, child[i] = index in the node array;
+// count[i] < 0: empty slot with inverted box that never gets hit.
+template <int N>
+struct alignas(32) WideBvhNode
+{
+	float bounds[2][3][N];
+	int child[N];
+	int count[N];
+};
+
+template <int N>
+class WideBvh
+{
+public:
+	// Collapse a binary Bvh by repeatedly opening the child with the
+	// largest surface area until every node holds N children
+	void Build(const Bvh& bvh);
+
+	// Closest hit, visiting hit children in near-to-far order
+	bool Intersect(
+		const PrimitiveCollide& collide,
+		const vec3& org,
+		const vec3& dir,
+		float& dist,
+		int* numVisits = nullptr) const;
+
+	const std::vector<WideBvhNode<N>>& GetNodes() const { return mNodes; }
+	const std::vector<Primitive>& GetPrimitives() const { return mPrimitives; }
+
+protected:
+	void CollapseRecursive(const Bvh& bvh, int binaryId, int wideId);
+
+protected:
+	std::vector<WideBvhNode<N>> mNodes;
+	std::vector<Primitive> mPrimitives;
+};
+
+using Bvh4 = WideBvh<4>;
+using Bvh8 = WideBvh<8>;
+
+// Compressed node of an N-wide Bvh. Children boxes are stored as 8-bit
+// offsets on a grid spanning the node box: per axis a,
+// min = origin[a] + qbounds[0][a][i] * 2^exponent[a],
+// max = origin[a] + qbounds[1][a][i] * 2^exponent[a].
+// Offsets are rounded outwards, so the boxes only grow and no hit is lost.
+// child and count follow WideBvhNode.
+template <int N>
+struct QuantizedBvhNode
+{
+	float origin[3];
+	int8_t exponent[3];
+	uint8_t qbounds[2][3][N];
+	int child[N];
+	int count[N];
+};
+
+template <int N>
+class QuantizedBvh
+{
+public:
+	// Quantize the children boxes of a wide Bvh, keeping its topology
+	void Build(const WideBvh<N>& bvh);
+
+	// Same hits and distances as WideBvh<N>::Intersect
+	bool Intersect(
+		const PrimitiveCollide& collide,
+		const vec3& org,
+		const vec3& dir,
+		float& dist,
+		int* numVisits = nullptr) const;
+
+	const std::vector<QuantizedBvhNode<N>>& GetNodes() const { return mNodes; }
+	const std::vector<Primitive>& GetPrimitives() const { return mPrimitives; }
+
+protected:
+	std::vector<QuantizedBvhNode<N>> mNodes;
+	std::vector<Primitive> mPrimitives;
+};
+
+using QBvh4 = QuantizedBvh<4>;
+using QBvh8 = QuantizedBvh<8>;
+
+#endif // !WIDE_BOUNDING_VOLUME_HIERARCHY_H